@@ -0,0 +1,260 @@
+// Micro and macro benchmarks of the converter on made-up corpora.
+//
+//   dsl_bench [--filter SUBSTRING] [--min-time SECONDS] [--articles N]
+//   dsl_bench --dsl KIND N > dictionary.dsl
+//
+// Each benchmark prints one line of JSON, so that runs can be kept and compared
+// with compare.py.
+
+#include "../src/dsl.h"
+#include "corpus.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+// Every heap allocation of the process, for the allocations per article of each benchmark
+static std::size_t allocations;
+
+void *operator new(std::size_t size)
+{
+	allocations++;
+	if (void *p = std::malloc(size ? size : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+	const std::string base_url_static_files = "https://example.com/static/";
+	const std::string base_url_lookup = "https://example.com/lookup?word=";
+
+	struct options
+	{
+		std::string filter;
+		double min_time = 0.5; // seconds per benchmark
+		std::size_t articles = 0;  // 0 for the default of each corpus
+	};
+
+	// Stops the compiler from dropping work whose result is never used
+	volatile std::size_t sink;
+
+	std::size_t default_articles(corpus_kind kind)
+	{
+		switch (kind)
+		{
+		case corpus_kind::realistic:
+			return 20000;
+		case corpus_kind::huge_text:
+			return 4;
+		case corpus_kind::short_text:
+			return 20000;
+		default:
+			return 200;
+		}
+	}
+
+	/**
+	 * @brief Runs one pass over the corpus in rounds until min_time is up, and
+	 * prints the best round.
+	 */
+	void run(const options &opts, const char *bench, corpus_kind kind, const std::vector<std::string> &corpus,
+			 const std::function<void(const std::string &)> &work)
+	{
+		const std::string name = std::string(bench) + "/" + corpus_name(kind);
+		if (name.find(opts.filter) == std::string::npos)
+		{
+			return;
+		}
+
+		std::size_t bytes = 0;
+		for (auto const &article : corpus)
+		{
+			bytes += article.size();
+		}
+
+		double best = 0;
+		double total = 0;
+		std::size_t round_allocations;
+		do
+		{
+			round_allocations = allocations;
+			const auto start = std::chrono::steady_clock::now();
+			for (auto const &article : corpus)
+			{
+				work(article);
+			}
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			round_allocations = allocations - round_allocations;
+			best = best == 0 || seconds < best ? seconds : best;
+			total += seconds;
+		} while (total < opts.min_time);
+
+		// Of the last round, once reused buffers have grown
+		std::printf("{\"bench\": \"%s\", \"corpus\": \"%s\", \"articles\": %zu, \"bytes\": %zu, "
+					"\"seconds\": %.6f, \"mb_per_s\": %.2f, \"articles_per_s\": %.1f, \"allocations_per_article\": %.2f}\n",
+					bench, corpus_name(kind), corpus.size(), bytes, best, bytes / best / 1e6, corpus.size() / best,
+					static_cast<double>(round_allocations) / corpus.size());
+		std::fflush(stdout);
+	}
+
+	void run_all(const options &opts)
+	{
+		for (int k = 0; k < static_cast<int>(corpus_kind::count); k++)
+		{
+			const corpus_kind kind = static_cast<corpus_kind>(k);
+			const std::vector<std::string> corpus = generate_corpus(kind, opts.articles ? opts.articles : default_articles(kind));
+
+			std::string scratch;
+			dom tree;
+			builder b(base_url_static_files, base_url_lookup, scratch);
+
+			// Taking out {{comments}}, [trn], [*] and the like
+			run(opts, "strip", kind, corpus, [&](const std::string &article)
+				{
+					dom::remove_unwanted_tags(article.data(), article.size(), scratch);
+					sink = scratch.size(); });
+
+			// Preprocessing and tokenizing happen in the same pass as building the tree
+			run(opts, "parse", kind, corpus, [&](const std::string &article)
+				{
+					tree.load(article.data(), article.size());
+					sink = tree.nodes.size(); });
+
+			// Writing the HTML of trees parsed beforehand
+			std::vector<dom> trees;
+			if (std::string("build/").append(corpus_name(kind)).find(opts.filter) != std::string::npos)
+			{
+				trees.reserve(corpus.size());
+				for (auto const &article : corpus)
+				{
+					trees.emplace_back(article);
+				}
+			}
+			std::size_t next_tree = 0;
+			run(opts, "build", kind, corpus, [&](const std::string &)
+				{
+					sink = b.get_html(trees[next_tree++ % trees.size()]).size(); });
+			trees.clear();
+
+			run(opts, "escape", kind, corpus, [&](const std::string &article)
+				{
+					scratch.clear();
+					html_escape_append(scratch, article.data(), article.size(), true);
+					sink = scratch.size(); });
+
+			run(opts, "text", kind, corpus, [&](const std::string &article)
+				{
+					tree.load(article.data(), article.size());
+					scratch.clear();
+					tree.append_text(tree.root(), scratch);
+					sink = scratch.size(); });
+
+			// The whole of to_html, with fresh objects every time
+			run(opts, "to_html", kind, corpus, [&](const std::string &article)
+				{
+					dom fresh(article);
+					builder fresh_builder(base_url_static_files, base_url_lookup);
+					sink = fresh_builder.get_html(fresh).size(); });
+
+			// The same, reusing the tree and the buffers as a Converter does
+			run(opts, "convert", kind, corpus, [&](const std::string &article)
+				{
+					tree.load(article.data(), article.size());
+					sink = b.get_html(tree).size(); });
+		}
+	}
+
+	corpus_kind kind_named(const std::string &name)
+	{
+		for (int k = 0; k < static_cast<int>(corpus_kind::count); k++)
+		{
+			if (name == corpus_name(static_cast<corpus_kind>(k)))
+			{
+				return static_cast<corpus_kind>(k);
+			}
+		}
+		throw std::invalid_argument("unknown corpus " + name);
+	}
+
+	// Wraps the articles into a dictionary for the Python benchmarks
+	void write_dsl(corpus_kind kind, std::size_t articles)
+	{
+		std::cout << "#NAME\t\"" << corpus_name(kind) << "\"\n#INDEX_LANGUAGE\t\"English\"\n#CONTENTS_LANGUAGE\t\"English\"\n\n";
+		const std::vector<std::string> corpus = generate_corpus(kind, articles);
+		for (std::size_t i = 0; i < corpus.size(); i++)
+		{
+			std::cout << "headword " << i << '\n';
+
+			// Every line of the body must start with a space or a tab
+			const std::string &body = corpus[i];
+			for (std::size_t from = 0; from < body.size();)
+			{
+				std::size_t to = body.find('\n', from);
+				if (to == std::string::npos)
+				{
+					to = body.size();
+				}
+				const char first = body[from];
+				std::cout << (first == ' ' || first == '\t' ? "" : "\t");
+				std::cout.write(body.data() + from, to - from) << '\n';
+				from = to + 1;
+			}
+			std::cout << '\n';
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	options opts;
+	try
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			const std::string arg = argv[i];
+			if (arg == "--filter" && i + 1 < argc)
+			{
+				opts.filter = argv[++i];
+			}
+			else if (arg == "--min-time" && i + 1 < argc)
+			{
+				opts.min_time = std::atof(argv[++i]);
+			}
+			else if (arg == "--articles" && i + 1 < argc)
+			{
+				opts.articles = std::strtoul(argv[++i], nullptr, 10);
+			}
+			else if (arg == "--dsl" && i + 2 < argc)
+			{
+				write_dsl(kind_named(argv[i + 1]), std::strtoul(argv[i + 2], nullptr, 10));
+				return 0;
+			}
+			else
+			{
+				std::cerr << "usage: " << argv[0] << " [--filter SUBSTRING] [--min-time SECONDS] [--articles N]\n"
+						  << "       " << argv[0] << " --dsl KIND N > dictionary.dsl\n";
+				return 2;
+			}
+		}
+		run_all(opts);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
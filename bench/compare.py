@@ -0,0 +1,40 @@
+"""Compares two runs of dsl_bench.
+
+    python3 compare.py before.jsonl after.jsonl
+
+Prints the throughput of every benchmark found in both, how many times faster
+the second run is, and the heap allocations per article of each.
+"""
+
+import json
+import sys
+
+
+def load(path):
+	results = {}
+	with open(path) as f:
+		for line in f:
+			line = line.strip()
+			if line.startswith('{'):
+				r = json.loads(line)
+				results[(r['bench'], r['corpus'])] = r
+	return results
+
+
+def main():
+	if len(sys.argv) != 3:
+		sys.exit(__doc__)
+	before, after = load(sys.argv[1]), load(sys.argv[2])
+
+	print(f'{"benchmark":<26}{"before MB/s":>14}{"after MB/s":>14}{"speedup":>10}{"allocs before":>15}{"allocs after":>14}')
+	for key, old in before.items():
+		new = after.get(key)
+		if new is None:
+			continue
+		print(f'{key[0] + "/" + key[1]:<26}{old["mb_per_s"]:>14.2f}{new["mb_per_s"]:>14.2f}'
+			  f'{old["seconds"] / new["seconds"]:>9.2f}x'
+			  f'{old.get("allocations_per_article", float("nan")):>15.2f}{new.get("allocations_per_article", float("nan")):>14.2f}')
+
+
+if __name__ == '__main__':
+	main()
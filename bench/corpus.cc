@@ -0,0 +1,235 @@
+#include "corpus.h"
+
+#include <random>
+
+namespace
+{
+	class article_writer
+	{
+	private:
+		std::mt19937 random;
+
+		const std::vector<std::string> words = {
+			"the", "a", "device", "that", "connects", "motor", "to", "electricity", "supply", "changing",
+			"direction", "in", "which", "flows", "of", "someone", "something", "especially", "used", "when",
+			"you", "are", "talking", "about", "very", "large", "small", "number", "people", "place"};
+		const std::vector<std::string> colours = {"green", "darkslategray", "rosybrown", "darkmagenta", "darkcyan", "orange"};
+		const std::vector<std::string> labels = {"noun", "verb", "adj", "BrE", "NAmE", "informal", "formal"};
+
+	public:
+		std::string out;
+
+		explicit article_writer(unsigned seed) : random(seed) {}
+
+		std::size_t below(std::size_t n) { return std::uniform_int_distribution<std::size_t>(0, n - 1)(random); }
+		bool chance(double p) { return std::bernoulli_distribution(p)(random); }
+		const std::string &pick(const std::vector<std::string> &from) { return from[below(from.size())]; }
+
+		void text(std::size_t word_count)
+		{
+			for (std::size_t i = 0; i < word_count; i++)
+			{
+				if (i)
+				{
+					out.push_back(' ');
+				}
+				out.append(pick(words));
+				if (chance(0.02))
+				{
+					out.append(chance(0.5) ? " \\[sic\\]" : " & <");
+				}
+			}
+		}
+
+		void media(const std::string &extension)
+		{
+			out.append("[s]").append(pick(words)).append("_").append(std::to_string(below(100000))).append(extension).append("[/s]");
+		}
+
+		void link(std::size_t word_count)
+		{
+			out.append("<<");
+			text(word_count);
+			out.append(">>");
+		}
+
+		void headword_line()
+		{
+			out.append(" [m0][b]");
+			text(1 + below(3));
+			out.append("[/b] [p]").append(pick(labels)).append("[/p] {{id=").append(std::to_string(below(1000000))).append("}} ");
+			out.append("[c ").append(pick(colours)).append("]\\[");
+			text(1);
+			out.append("\\][/c] ");
+			media(".wav");
+			out.append(" [trn][c orange] ").append(pick(labels)).append("[/c][/trn]\n");
+		}
+
+		void gloss()
+		{
+			out.append("[b]");
+			text(1);
+			out.append("[/b]");
+			if (chance(0.5))
+			{
+				out.append(" [p]").append(pick(labels)).append("[/p]");
+			}
+			out.push_back(' ');
+			text(below(4));
+		}
+
+		void sense(int level, int number)
+		{
+			out.append(" [m").append(std::to_string(level)).append("][c darkmagenta][b]").append(std::to_string(number)).append(".[/b][/c] ");
+			if (chance(0.3))
+			{
+				out.append("[i]");
+				text(1 + below(3));
+				out.append("[/i] ");
+			}
+			out.append("{{d}}");
+			text(5 + below(15));
+			out.append("{{/d}}");
+			if (chance(0.3))
+			{
+				out.append(" see ");
+				link(1 + below(2));
+			}
+			out.append("[/m]\n");
+
+			for (std::size_t e = below(3); e > 0; e--)
+			{
+				out.append(" [m").append(std::to_string(level + 1)).append("][ex][*][lang id=1033]");
+				text(4 + below(10));
+				out.append("[/lang][/*][/ex][/m]\n");
+			}
+		}
+	};
+
+	std::string realistic(article_writer &w)
+	{
+		w.out.clear();
+		w.headword_line();
+		for (int sense = 1, senses = 1 + w.below(8); sense <= senses; sense++)
+		{
+			w.sense(1 + (sense > 3), sense);
+		}
+		if (w.chance(0.2))
+		{
+			w.out.append(" [m1][ref]");
+			w.text(2);
+			w.out.append("[/ref] [url]https://example.com/").append(std::to_string(w.below(1000))).append("[/url][/m]\n");
+		}
+		return w.out;
+	}
+
+	// Lines of tags nested hundreds deep, then an [m] that all of them are moved under
+	std::string deep_nesting(article_writer &w)
+	{
+		static const char *const tags[] = {"[b]", "[i]", "[u]", "[c red]", "[sub]", "[sup]"};
+
+		w.out.clear();
+		for (std::size_t line = 10 + w.below(20); line > 0; line--)
+		{
+			for (std::size_t depth = 50 + w.below(250); depth > 0; depth--)
+			{
+				w.out.append(tags[depth % 6]);
+				w.text(1);
+			}
+			w.out.append("[m1]");
+			w.text(3 + w.below(5));
+			w.out.append("[/m]\n");
+		}
+		return w.out;
+	}
+
+	std::string huge_text(article_writer &w)
+	{
+		w.out.clear();
+		w.out.append("[m1]");
+		while (w.out.size() < (1 << 20))
+		{
+			w.text(1000);
+		}
+		w.out.append("[/m]\n");
+		return w.out;
+	}
+
+	std::string many_media(article_writer &w)
+	{
+		static const std::vector<std::string> extensions = {".wav", ".mp3", ".jpg", ".png", ".mp4", ".ogg"};
+
+		w.out.clear();
+		w.out.append("[m1]");
+		for (std::size_t i = 200 + w.below(200); i > 0; i--)
+		{
+			w.media(w.pick(extensions));
+			w.out.push_back(' ');
+		}
+		w.out.append("[/m]\n");
+		return w.out;
+	}
+
+	std::string long_links(article_writer &w)
+	{
+		w.out.clear();
+		for (std::size_t i = 10 + w.below(20); i > 0; i--)
+		{
+			w.out.append(" [m1]see <<");
+			for (std::size_t j = 30 + w.below(300); j > 0; j--)
+			{
+				w.text(1);
+				w.out.append(w.chance(0.1) ? " [b]x[/b] " : " ");
+			}
+			w.out.append(">>[/m]\n");
+		}
+		return w.out;
+	}
+
+	// From 5 to 45 bytes or so, as cross-references and one-line glosses are
+	std::string short_text(article_writer &w)
+	{
+		w.out.clear();
+		w.gloss();
+		return w.out;
+	}
+}
+
+const char *corpus_name(corpus_kind kind)
+{
+	static const char *const names[] = {"realistic", "deep_nesting", "huge_text", "many_media", "long_links", "short_text"};
+	return names[static_cast<std::size_t>(kind)];
+}
+
+std::vector<std::string> generate_corpus(corpus_kind kind, std::size_t articles, unsigned seed)
+{
+	article_writer w(seed);
+	std::vector<std::string> corpus;
+	corpus.reserve(articles);
+
+	for (std::size_t i = 0; i < articles; i++)
+	{
+		switch (kind)
+		{
+		case corpus_kind::realistic:
+			corpus.push_back(realistic(w));
+			break;
+		case corpus_kind::deep_nesting:
+			corpus.push_back(deep_nesting(w));
+			break;
+		case corpus_kind::huge_text:
+			corpus.push_back(huge_text(w));
+			break;
+		case corpus_kind::many_media:
+			corpus.push_back(many_media(w));
+			break;
+		case corpus_kind::long_links:
+			corpus.push_back(long_links(w));
+			break;
+		default:
+			corpus.push_back(short_text(w));
+			break;
+		}
+	}
+	return corpus;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+enum class corpus_kind
+{
+	realistic,	  // dictionary articles: senses, examples, colours, media, links
+	deep_nesting, // tags nested hundreds deep, reopened under an [m]
+	huge_text,	  // megabyte runs of plain text
+	many_media,	  // hundreds of [s] tags per article
+	long_links,	  // <<links>> thousands of characters long, with markup inside
+	short_text,	  // a few words with a tag or two, where the cost of each call shows
+	count
+};
+
+const char *corpus_name(corpus_kind kind);
+
+/**
+ * @brief Makes up articles of the given kind. The same seed always gives the same articles.
+ */
+std::vector<std::string> generate_corpus(corpus_kind kind, std::size_t articles, unsigned seed = 1);
@@ -0,0 +1,123 @@
+// Checks dom::remove_unwanted_tags against the std::regex chain it replaced, on
+// random inputs made of tag fragments, and times both.
+//
+//   strip_check [--inputs N] [--seed S]
+//
+// Prints the first input on which they differ and exits with 1, or one line of
+// JSON per implementation.
+
+#include "../src/dsl.h"
+#include "corpus.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <regex>
+
+namespace
+{
+	const std::regex re_brackets_blocks(R"(\{\{[^}]*\}\})");
+	const std::regex re_trn_trs_tags(R"(\[(/?)(\!?)tr[ns]\])");
+	const std::regex re_lang_close(R"(\[/lang\])");
+	const std::regex re_com_tags(R"(\[(/?)com\])");
+	const std::regex re_t_tags(R"(\[(/?)t\])");
+	const std::regex re_asterisk_tags(R"(\[(/?)\*\])");
+
+	// The old remove_unwanted_tags: each pass removes one kind of tag from the output of the previous one
+	std::string remove_unwanted_tags_regex(const std::string &dsl_text)
+	{
+		std::string text = std::regex_replace(dsl_text, re_brackets_blocks, "");
+		text = std::regex_replace(text, re_trn_trs_tags, "");
+		text = std::regex_replace(text, re_lang_close, "");
+		text = std::regex_replace(text, re_com_tags, "");
+		text = std::regex_replace(text, re_t_tags, "");
+		return std::regex_replace(text, re_asterisk_tags, "");
+	}
+
+	// Pieces that glue into tags, half tags and tags broken by other tags
+	const std::vector<std::string> fragments = {
+		"[", "]", "/", "!", "{", "}", "{{", "}}", "t", "tr", "n", "s", "com", "lang", "*", "x", " ", "\n", "\\[",
+		"[t]", "[/t]", "[*]", "[/*]", "[com]", "[/com]", "[trn]", "[/trn]", "[!trs]", "[/!trs]", "[trs]",
+		"[lang id=1]", "[/lang]", "[m1]", "[/m]", "{{x}}", "{{", "[t{{c}}]", "[/{{c}}lang]", "[c]", "[/c]"};
+
+	std::string random_input(std::mt19937 &random)
+	{
+		std::uniform_int_distribution<std::size_t> length(0, 24);
+		std::uniform_int_distribution<std::size_t> fragment(0, fragments.size() - 1);
+		std::string input;
+		for (std::size_t n = length(random); n; n--)
+		{
+			input.append(fragments[fragment(random)]);
+		}
+		return input;
+	}
+
+	template <typename Strip>
+	void time_strip(const char *name, const std::vector<std::string> &corpus, Strip strip)
+	{
+		std::size_t bytes = 0;
+		for (auto const &article : corpus)
+		{
+			bytes += article.size();
+		}
+		const auto start = std::chrono::steady_clock::now();
+		std::size_t kept = 0;
+		for (auto const &article : corpus)
+		{
+			kept += strip(article);
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::printf("{\"bench\": \"%s\", \"corpus\": \"realistic\", \"articles\": %zu, \"bytes\": %zu, "
+					"\"seconds\": %.6f, \"mb_per_s\": %.2f, \"kept\": %zu}\n",
+					name, corpus.size(), bytes, seconds, bytes / seconds / 1e6, kept);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::size_t inputs = 1000000;
+	unsigned seed = 1;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if (arg == "--inputs" && i + 1 < argc)
+		{
+			inputs = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--seed" && i + 1 < argc)
+		{
+			seed = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--inputs N] [--seed S]\n";
+			return 2;
+		}
+	}
+
+	std::mt19937 random(seed);
+	std::string result;
+	for (std::size_t i = 0; i < inputs; i++)
+	{
+		const std::string input = random_input(random);
+		dom::remove_unwanted_tags(input.data(), input.size(), result);
+		const std::string expected = remove_unwanted_tags_regex(input);
+		if (result != expected)
+		{
+			std::cout << "input:    " << input << "\nexpected: " << expected << "\ngot:      " << result << '\n';
+			return 1;
+		}
+	}
+	std::cerr << inputs << " inputs, no differences\n";
+
+	const std::vector<std::string> corpus = generate_corpus(corpus_kind::realistic, 2000);
+	time_strip("strip_regex", corpus, [](const std::string &article)
+		 { return remove_unwanted_tags_regex(article).size(); });
+	time_strip("strip", corpus, [&result](const std::string &article)
+		 {
+			 dom::remove_unwanted_tags(article.data(), article.size(), result);
+			 return result.size(); });
+	return 0;
+}
@@ -1,14 +1,46 @@
 #!/usr/bin/env python3
 
+import os
+import sys
+
 from setuptools import Extension, setup
 
+threads = [] if sys.platform == 'win32' else ['-pthread']
+libraries = []
+include_dirs = []
+library_dirs = []
+define_macros = []
+
+# zlib, for dictzip files, comes with Linux and macOS. Windows has none: ZLIB_ROOT may name
+# a directory holding include\zlib.h and lib\zlib.lib, and without it .dz files raise an error.
+if sys.platform != 'win32':
+	libraries.append('z')
+elif os.environ.get('ZLIB_ROOT'):
+	include_dirs.append(os.path.join(os.environ['ZLIB_ROOT'], 'include'))
+	library_dirs.append(os.path.join(os.environ['ZLIB_ROOT'], 'lib'))
+	libraries.append('zlib')
+else:
+	define_macros.append(('DSL_NO_ZLIB', '1'))
+
+if sys.platform.startswith('linux'):
+	libraries.append('rt')  # shm_open, for glibc before 2.34
+
+# DSL_STATS=1 builds in the counters read by dsl.stats()
+if os.environ.get('DSL_STATS', '0') not in ('', '0'):
+	define_macros.append(('DSL_STATS', '1'))
+
 setup(
 	name='dsl',
 	ext_modules=[
 		Extension(
 			'dsl',
-			['src/utils.cc', 'src/parse.cc', 'src/build.cc', 'src/dslmodule.cc'],
-			extra_compile_args=['-std=c++11']
+			['src/utils.cc', 'src/parse.cc', 'src/build.cc', 'src/reader.cc', 'src/index.cc', 'src/search.cc', 'src/dawg.cc', 'src/dictzip.cc', 'src/cache.cc', 'src/shared_cache.cc', 'src/export.cc', 'src/stats.cc', 'src/dslmodule.cc'],
+			include_dirs=include_dirs,
+			libraries=libraries,
+			library_dirs=library_dirs,
+			define_macros=define_macros,
+			extra_compile_args=['-std=c++11'] + threads,
+			extra_link_args=threads
 		)
 	]
 )
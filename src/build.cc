@@ -1,7 +1,6 @@
 #include "dsl.h"
 
-#include <algorithm>
-#include <functional>
+#include <chrono>
 
 bool builder::is_image(const std::string &filename)
 {
@@ -81,285 +80,262 @@ bool builder::is_video(const std::string &filename)
 	return false;
 }
 
-std::string builder::get_node_link(const node &n)
+std::string builder::get_node_link(const node &n) const
 {
 	std::string link_text;
 
-	if (!n.tag_attrs.empty())
+	if (n.tag_attrs.size)
 	{
-		std::size_t i = n.tag_attrs.find("target=\"");
+		std::string tag_attrs = tree->str(n.tag_attrs);
+		std::size_t i = tag_attrs.find("target=\"");
 		if (i > 0)
 		{
-			std::size_t end = n.tag_attrs.find("\"", i + 8);
+			std::size_t end = tag_attrs.find("\"", i + 8);
 			if (end > i + 8)
 			{
-				link_text = n.tag_attrs.substr(i + 8, end - i - 8);
+				link_text = tag_attrs.substr(i + 8, end - i - 8);
 			}
 			else
 			{
-				link_text = n.tag_attrs.substr(i + 8);
+				link_text = tag_attrs.substr(i + 8);
 			}
 		}
 	}
 
 	if (link_text.empty())
 	{
-		link_text = n.to_string();
+		link_text = tree->to_string(n);
 	}
 
 	trim(link_text);
 	return html_escape(link_text);
 }
 
-void builder::write_children(const node &n)
+bool builder::open_b(const node &)
 {
-	std::for_each(n.cbegin(), n.cend(), std::bind(&builder::node_to_html, this, std::placeholders::_1));
+	html.append("<b>");
+	return true;
 }
 
-void builder::write_text(const node &n)
+bool builder::open_i(const node &)
 {
-	std::string text = html_escape(n.text);
-
-	// Handle all end-of-line
-	std::size_t i;
-
-	// Strip '\r'
-	while ((i = text.find('\r')) != std::string::npos)
-	{
-		text.erase(i, 1);
-	}
-
-	// Replace all '\n'
-	while ((i = text.find('\n')) != std::string::npos)
-	{
-		// text.replace(i, 1, "<br />");
-		text.erase(i, 1);
-	}
-
-	html_stream << text;
-}
-
-void builder::write_b(const node &n)
-{
-	html_stream << "<b>";
-	write_children(n);
-	html_stream << "</b>";
-}
-
-void builder::write_i(const node &n)
-{
-	html_stream << "<i>";
-	write_children(n);
-	html_stream << "</i>";
+	html.append("<i>");
+	return true;
 }
 
-void builder::write_u(const node &n)
+bool builder::open_u(const node &)
 {
-	html_stream << "<u>";
-	write_children(n);
-	html_stream << "</u>";
+	html.append("<u>");
+	return true;
 }
 
-void builder::write_sub(const node &n)
+bool builder::open_sub(const node &)
 {
-	html_stream << "<sub>";
-	write_children(n);
-	html_stream << "</sub>";
+	html.append("<sub>");
+	return true;
 }
 
-void builder::write_sup(const node &n)
+bool builder::open_sup(const node &)
 {
-	html_stream << "<sup>";
-	write_children(n);
-	html_stream << "</sup>";
+	html.append("<sup>");
+	return true;
 }
 
-void builder::write_colour(const node &n)
+bool builder::open_colour(const node &n)
 {
-	std::string colour = n.tag_attrs;
+	std::string colour = tree->str(n.tag_attrs);
 	trim(colour);
 
 	if (colour.empty())
 	{
-		html_stream << "<span style=\"color: darkgreen;\">";
+		html.append("<span style=\"color: darkgreen;\">");
 	}
 	else
 	{
-		html_stream << "<span style=\"color: " << colour << ";\">";
+		html.append("<span style=\"color: ").append(colour).append(";\">");
 	}
-
-	write_children(n);
-	html_stream << "</span>";
+	return true;
 }
 
-void builder::write_m(const node &n)
+bool builder::open_m(const node &)
 {
-	html_stream << "<div>";
-	write_children(n);
-	html_stream << "</div>";
+	html.append("<div>");
+	return true;
 }
 
-void builder::write_m_n(const node &n)
+bool builder::open_m_n(const node &n)
 {
-	int level = n.tag_name[1] - '0';
-	html_stream << "<div style=\"margin-left: " << std::to_string(level * 9) << "px;\">";
-	write_children(n);
-	html_stream << "</div>";
+	static const char *const margins[] = {"0", "9", "18", "27", "36", "45", "54", "63", "72", "81"}; // 9px a level
+	int level = static_cast<int>(n.tag) - static_cast<int>(tag_kind::m0);
+	html.append("<div style=\"margin-left: ").append(margins[level]).append("px;\">");
+	return true;
 }
 
-void builder::write_example(const node &n)
+bool builder::open_example(const node &)
 {
-	html_stream << "<span style=\"color: grey;\">";
-	write_children(n);
-	html_stream << "</span>";
+	html.append("<span style=\"color: grey;\">");
+	return true;
 }
 
-void builder::write_media(const node &n)
+bool builder::open_media(const node &n)
 {
-	std::string filename = n.to_string();
+	std::string filename = tree->to_string(n);
 	trim(filename);
 	resources_name.push_back(filename);
 
 	if (is_image(filename))
 	{
-		html_stream << "<img src=\"" << base_url_static_files << filename << "\" alt=\"" << filename << "\"/>";
+		html.append("<img src=\"").append(base_url_static_files).append(filename).append("\" alt=\"").append(filename).append("\"/>");
 	}
 	else if (is_audio(filename))
 	{
 		if (audio_found)
 		{
-			html_stream << "<audio controls src=\"" << base_url_static_files << filename << "\">" << filename << "</audio>";
+			html.append("<audio controls src=\"").append(base_url_static_files).append(filename).append("\">").append(filename).append("</audio>");
 		}
 		else
 		{
-			html_stream << "<audio controls autoplay src=\"" << base_url_static_files << filename << "\">" << filename << "</audio>";
+			html.append("<audio controls autoplay src=\"").append(base_url_static_files).append(filename).append("\">").append(filename).append("</audio>");
 			audio_found = true;
 		}
 	}
 	else if (is_video(filename))
 	{
-		html_stream << "<video controls src=\"" << base_url_static_files << filename << "\">" << filename << "</video>";
+		html.append("<video controls src=\"").append(base_url_static_files).append(filename).append("\">").append(filename).append("</video>");
 	}
 	else
 	{
-		html_stream << "<a href=\"" << base_url_static_files << filename << "\">" << filename << "</a>";
+		html.append("<a href=\"").append(base_url_static_files).append(filename).append("\">").append(filename).append("</a>");
 	}
+	return false;
 }
 
-void builder::write_ref(const node &n)
+bool builder::open_ref(const node &n)
 {
 	std::string headword = get_node_link(n);
-	html_stream << "<a href=\"" << base_url_lookup << headword << "\">" << headword << "</a>";
+	html.append("<a href=\"").append(base_url_lookup).append(headword).append("\">").append(headword).append("</a>");
+	return false;
 }
 
-void builder::write_url(const node &n)
+bool builder::open_url(const node &n)
 {
 	std::string url = get_node_link(n);
-	html_stream << "<a href=\"" << url << "\">" << url << "</a>";
+	html.append("<a href=\"").append(url).append("\">").append(url).append("</a>");
+	return false;
 }
 
-void builder::write_p(const node &n)
+bool builder::open_p(const node &)
 {
 	// See rule for dsl_p in GoldenDict's source code
-	html_stream << "<span style=\"color: green; font-style: italic;\">";
-	write_children(n);
-	html_stream << "</span>";
+	html.append("<span style=\"color: green; font-style: italic;\">");
+	return true;
 }
 
-void builder::write_br(const node &n)
+bool builder::open_br(const node &)
 {
-	html_stream << "<br/>";
+	html.append("<br/>");
 	// It won't hurt if we write children here
-	write_children(n);
+	return true;
 }
 
-void builder::write_unknown(const node &n)
+bool builder::open_unknown(const node &)
 {
-	html_stream << "<span>";
-	write_children(n);
-	html_stream << "</span>";
+	html.append("<span>");
+	return true;
 }
 
-void builder::node_to_html(const node &n)
+const std::array<builder::tag_writer, static_cast<std::size_t>(tag_kind::count)> builder::writers = {{
+	{nullptr, ""},					   // text, written by get_html itself
+	{&builder::open_unknown, "</span>"}, // unknown
+	{&builder::open_b, "</b>"},		   // b
+	{&builder::open_i, "</i>"},		   // i
+	{&builder::open_u, "</u>"},		   // u
+	{&builder::open_u, "</u>"},		   // apostrophe
+	{&builder::open_sub, "</sub>"},	   // sub
+	{&builder::open_sup, "</sup>"},	   // sup
+	{&builder::open_colour, "</span>"},  // c
+	{&builder::open_m, "</div>"},		   // m
+	{&builder::open_m_n, "</div>"},	   // m0
+	{&builder::open_m_n, "</div>"},	   // m1
+	{&builder::open_m_n, "</div>"},	   // m2
+	{&builder::open_m_n, "</div>"},	   // m3
+	{&builder::open_m_n, "</div>"},	   // m4
+	{&builder::open_m_n, "</div>"},	   // m5
+	{&builder::open_m_n, "</div>"},	   // m6
+	{&builder::open_m_n, "</div>"},	   // m7
+	{&builder::open_m_n, "</div>"},	   // m8
+	{&builder::open_m_n, "</div>"},	   // m9
+	{&builder::open_example, "</span>"}, // ex
+	{&builder::open_media, ""},		   // s
+	{&builder::open_media, ""},		   // video
+	{&builder::open_ref, ""},			   // ref
+	{&builder::open_url, ""},			   // url
+	{&builder::open_p, "</span>"},	   // p
+	{&builder::open_br, ""},			   // br
+}};
+
+builder::builder(const std::string &base_url_static_files, const std::string &base_url_lookup)
+	: builder(base_url_static_files, base_url_lookup, own_html)
 {
-	if (!n.is_tag)
-	{
-		write_text(n);
-	}
-	else
-	{
-		if (n.tag_name == "b")
-		{
-			write_b(n);
-		}
-		else if (n.tag_name == "i")
-		{
-			write_i(n);
-		}
-		else if (n.tag_name == "u" || n.tag_name == "'")
-		{
-			write_u(n);
-		}
-		else if (n.tag_name == "sub")
-		{
-			write_sub(n);
-		}
-		else if (n.tag_name == "sup")
-		{
-			write_sup(n);
-		}
-		else if (n.tag_name == "c")
-		{
-			write_colour(n);
-		}
-		else if (n.tag_name == "m")
-		{
-			write_m(n);
-		}
-		else if (n.tag_name.size() == 2 && n.tag_name[0] == 'm' && std::isdigit(n.tag_name[1]))
-		{
-			write_m_n(n);
-		}
-		else if (n.tag_name == "ex")
-		{
-			write_example(n);
-		}
-		else if (n.tag_name == "s" || n.tag_name == "video")
-		{
-			write_media(n);
-		}
-		else if (n.tag_name == "ref")
-		{
-			write_ref(n);
-		}
-		else if (n.tag_name == "url")
-		{
-			write_url(n);
-		}
-		else if (n.tag_name == "p")
-		{
-			write_p(n);
-		}
-		else if (n.tag_name == "br")
-		{
-			write_br(n);
-		}
-		else
-		{
-			write_unknown(n);
-		}
-	}
 }
 
-builder::builder(const std::string &base_url_static_files, const std::string &base_url_lookup)
+builder::builder(const std::string &base_url_static_files, const std::string &base_url_lookup, std::string &html)
 	: base_url_static_files(base_url_static_files)
 	, base_url_lookup(base_url_lookup)
 	, audio_found(false)
+	, tree(nullptr)
+	, html(html)
 {
 }
 
-std::string builder::get_html(const node &root)
+const std::string &builder::get_html(const dom &tree)
 {
-	write_children(root);
-	return html_stream.str();
+	typedef std::chrono::steady_clock clock;
+	clock::time_point start;
+	std::size_t capacity = 0;
+	if (stats_enabled)
+	{
+		capacity = html.capacity();
+		start = clock::now();
+	}
+
+	this->tree = &tree;
+	html.clear();
+	resources_name.clear();
+	audio_found = false;
+
+	// However deep the tree, without recursion. Text, the most common by far, is written right here.
+	auto open = [this](const node &n)
+	{
+		if (!n.is_tag)
+		{
+			// Line breaks in the source are not line breaks in the article
+			html_escape_append(html, this->tree->data(n.text), n.text.size, true);
+			return false;
+		}
+		return (this->*writers[static_cast<std::size_t>(n.tag)].open)(n);
+	};
+	auto close = [this](const node &n)
+	{
+		const char *end = writers[static_cast<std::size_t>(n.tag)].close;
+		if (*end)
+		{
+			html.append(end);
+		}
+	};
+	for (node_id c = tree.root().first_child; c; c = tree.nodes[c].next_sibling)
+	{
+		tree.walk(tree.nodes[c], open, close);
+	}
+
+	if (stats_enabled)
+	{
+		converter_stats s = converter_stats();
+		s.nanoseconds[converter_stats::build] = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+		s.calls[converter_stats::build] = 1;
+		s.html_bytes = html.size();
+		s.allocations = html.capacity() != capacity;
+		record_stats(s);
+	}
+	return html;
 }
@@ -0,0 +1,135 @@
+#include "dsl.h"
+
+#include <cstring>
+
+namespace
+{
+	// Roughly what an entry takes besides its strings
+	const std::size_t entry_overhead = 256;
+}
+
+std::uint64_t html_cache::hash(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup)
+{
+	std::uint64_t h = hash_bytes(0, dsl, size);
+	h = hash_bytes(h, base_url_static_files.data(), base_url_static_files.size());
+	return hash_bytes(h, base_url_lookup.data(), base_url_lookup.size());
+}
+
+html_cache::html_cache()
+	: max_bytes(0)
+	, hits(0)
+	, misses(0)
+	, evictions(0)
+{
+}
+
+void html_cache::evict(shard &s, std::size_t budget)
+{
+	while (s.bytes > budget)
+	{
+		entry &last = s.entries.back();
+		s.bytes -= last.bytes;
+		s.by_hash.erase(last.hash);
+		s.entries.pop_back();
+		evictions++;
+	}
+}
+
+void html_cache::set_max_bytes(std::size_t bytes)
+{
+	max_bytes = bytes;
+	for (auto &s : shards)
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		evict(s, bytes / shard_count);
+	}
+}
+
+void html_cache::clear()
+{
+	for (auto &s : shards)
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.entries.clear();
+		s.by_hash.clear();
+		s.bytes = 0;
+	}
+	hits = misses = evictions = 0;
+}
+
+html_cache::counters html_cache::get_counters() const
+{
+	counters c = {hits, misses, evictions, 0, 0, max_bytes};
+	for (auto &s : shards)
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		c.entries += s.entries.size();
+		c.bytes += s.bytes;
+	}
+	return c;
+}
+
+std::shared_ptr<const html_cache::result> html_cache::find(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup)
+{
+	if (!enabled())
+	{
+		return nullptr;
+	}
+
+	const std::uint64_t h = hash(dsl, size, base_url_static_files, base_url_lookup);
+	shard &s = shards[h % shard_count];
+
+	std::lock_guard<std::mutex> lock(s.mutex);
+	auto found = s.by_hash.find(h);
+	if (found == s.by_hash.end())
+	{
+		misses++;
+		return nullptr;
+	}
+
+	// The hash only picks the entry; the key itself has to match as well
+	entry &e = *found->second;
+	if (e.dsl.size() != size || std::memcmp(e.dsl.data(), dsl, size) != 0 ||
+		e.base_url_static_files != base_url_static_files || e.base_url_lookup != base_url_lookup)
+	{
+		misses++;
+		return nullptr;
+	}
+
+	s.entries.splice(s.entries.begin(), s.entries, found->second);
+	hits++;
+	return e.value;
+}
+
+void html_cache::insert(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup, std::shared_ptr<const result> value)
+{
+	const std::size_t budget = max_bytes / shard_count;
+
+	std::size_t bytes = entry_overhead + size + base_url_static_files.size() + base_url_lookup.size() + value->html.size();
+	for (auto const &name : value->resources_name)
+	{
+		bytes += name.size() + sizeof(std::string);
+	}
+	if (bytes > budget)
+	{
+		return; // Would push everything else out
+	}
+
+	const std::uint64_t h = hash(dsl, size, base_url_static_files, base_url_lookup);
+	shard &s = shards[h % shard_count];
+
+	std::lock_guard<std::mutex> lock(s.mutex);
+	auto found = s.by_hash.find(h);
+	if (found != s.by_hash.end())
+	{
+		// Put there by another thread meanwhile, or another key with the same hash
+		s.bytes -= found->second->bytes;
+		s.entries.erase(found->second);
+		s.by_hash.erase(found);
+	}
+
+	s.entries.push_front(entry{h, std::string(dsl, size), base_url_static_files, base_url_lookup, std::move(value), bytes});
+	s.by_hash[h] = s.entries.begin();
+	s.bytes += bytes;
+	evict(s, budget);
+}
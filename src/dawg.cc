@@ -0,0 +1,544 @@
+#include "dsl.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace
+{
+	// Reads UTF-8 a byte at a time; true once a character is complete
+	bool feed_utf8(std::uint32_t &value, int &remaining, unsigned char byte)
+	{
+		if (remaining && (byte & 0xC0) == 0x80)
+		{
+			value = (value << 6) | (byte & 0x3F);
+			return --remaining == 0;
+		}
+		if (byte >= 0xC0)
+		{
+			remaining = byte >= 0xF0 ? 3 : byte >= 0xE0 ? 2 : 1;
+			value = byte & (0x3F >> remaining);
+			return false;
+		}
+		value = byte; // not UTF-8, taken as a character of its own
+		remaining = 0;
+		return true;
+	}
+
+	std::string lookup_key(const std::string &word)
+	{
+		return fold_case(normalize_headword(word.data(), word.size()));
+	}
+}
+
+std::vector<std::string> headword_variants(const char *headword, std::size_t size)
+{
+	std::string stripped(headword, size);
+	dom::process_unsorted_parts(stripped, true);
+
+	struct pending
+	{
+		std::string text;
+		int expanded; // optional parts
+	};
+	std::vector<pending> work(1, pending{stripped, 0});
+	std::vector<std::string> variants;
+
+	while (!work.empty())
+	{
+		pending p = std::move(work.back());
+		work.pop_back();
+
+		// The first optional part, with any nested in it
+		std::size_t open = std::string::npos;
+		std::size_t close = std::string::npos;
+		int depth = 0;
+		for (std::size_t i = 0; p.expanded < 5 && i < p.text.size(); i++)
+		{
+			const char c = p.text[i];
+			if (c == '\\')
+			{
+				i++;
+			}
+			else if (c == '(')
+			{
+				if (!depth++)
+				{
+					open = i;
+				}
+			}
+			else if (c == ')' && depth && !--depth)
+			{
+				close = i;
+				break;
+			}
+		}
+
+		if (close == std::string::npos)
+		{
+			std::string key = fold_case(normalize_headword(p.text.data(), p.text.size()));
+			if (!key.empty() && std::find(variants.begin(), variants.end(), key) == variants.end())
+			{
+				variants.push_back(std::move(key));
+			}
+			continue;
+		}
+
+		const std::string before = p.text.substr(0, open);
+		const std::string after = p.text.substr(close + 1);
+		work.push_back(pending{before + after, p.expanded + 1});
+		work.push_back(pending{before + p.text.substr(open + 1, close - open - 1) + after, p.expanded + 1});
+	}
+	return variants;
+}
+
+/**
+ * @brief Builds the automaton from keys given in order, merging each node with an
+ * equal one already built as soon as no more keys can go through it (Daciuk et
+ * al., 2000), so that it never holds more than the minimal automaton and the
+ * path of the last key.
+ */
+class headword_dawg::builder
+{
+private:
+	struct open_node
+	{
+		bool final;
+		std::vector<dawg_edge> edges;
+	};
+
+	std::vector<open_node> path; // path[i] is reached by the first i bytes of the last key
+	std::string last;
+	std::unordered_map<std::string, std::uint32_t> built; // by what makes nodes equal
+
+	std::uint32_t freeze(const open_node &n)
+	{
+		std::string signature(1, n.final ? '\1' : '\0');
+		signature.append(reinterpret_cast<const char *>(n.edges.data()), n.edges.size() * sizeof(dawg_edge));
+
+		auto found = built.find(signature);
+		if (found != built.end())
+		{
+			return found->second;
+		}
+
+		dawg_node frozen;
+		frozen.first_edge = static_cast<std::uint32_t>(edges.size());
+		frozen.edge_count = static_cast<std::uint32_t>(n.edges.size());
+		frozen.key_count = n.final;
+		frozen.final = n.final;
+		for (auto const &e : n.edges)
+		{
+			frozen.key_count += nodes[e.target].key_count;
+		}
+		edges.insert(edges.end(), n.edges.begin(), n.edges.end());
+
+		const std::uint32_t id = static_cast<std::uint32_t>(nodes.size());
+		nodes.push_back(frozen);
+		built.emplace(std::move(signature), id);
+		return id;
+	}
+
+	// Freezes the nodes of the last key deeper than depth
+	void close_path(std::size_t depth)
+	{
+		while (path.size() > depth + 1)
+		{
+			const std::uint32_t id = freeze(path.back());
+			path.pop_back();
+			path.back().edges.push_back(dawg_edge{id, static_cast<unsigned char>(last[path.size() - 1])});
+		}
+	}
+
+public:
+	// Children come before their parents
+	std::vector<dawg_node> nodes;
+	std::vector<dawg_edge> edges;
+
+	builder() : path(1, open_node{false, std::vector<dawg_edge>()}) {}
+
+	// Keys must come sorted, each once, and not empty
+	void add(const std::string &key)
+	{
+		std::size_t common = 0;
+		while (common < last.size() && common < key.size() && last[common] == key[common])
+		{
+			common++;
+		}
+		close_path(common);
+
+		path.resize(key.size() + 1, open_node{false, std::vector<dawg_edge>()});
+		path.back().final = true;
+		last = key;
+	}
+
+	// The root
+	std::uint32_t finish()
+	{
+		close_path(0);
+		return freeze(path[0]);
+	}
+};
+
+const char headword_dawg::magic[8] = {'D', 'S', 'L', 'D', 'A', 'W', 'G', '1'};
+
+headword_dawg::headword_dawg(const std::string &path)
+	: file(path)
+{
+	const header *h = reinterpret_cast<const header *>(file.data());
+	if (file.size() < sizeof(header) || std::memcmp(h->magic, magic, sizeof(magic)) != 0)
+	{
+		throw std::runtime_error(path + " is not a DAWG of headwords");
+	}
+
+	// The numbers of the variants' headwords are padded to 64 bits
+	const std::uint64_t left = file.size() - sizeof(header);
+	const std::uint64_t limit = left / 4;
+	if (h->node_count > limit / 4 || h->edge_count > limit / 2 || h->key_count >= limit || h->value_count > limit ||
+		h->headword_count > limit / 2 || h->strings_size > left)
+	{
+		throw std::runtime_error(path + " is truncated");
+	}
+	const std::uint64_t numbers = (h->key_count + 1 + h->value_count + 1) / 2 * 2;
+	if (h->node_count * 16 + h->edge_count * 8 + numbers * 4 + h->headword_count * 8 + h->strings_size > left)
+	{
+		throw std::runtime_error(path + " is truncated");
+	}
+	if (h->root >= h->node_count)
+	{
+		throw std::runtime_error(path + " is corrupt");
+	}
+
+	node_count = h->node_count;
+	nodes = reinterpret_cast<const dawg_node *>(file.data() + sizeof(header));
+	edge_count = h->edge_count;
+	edges = reinterpret_cast<const dawg_edge *>(nodes + node_count);
+	root = static_cast<std::uint32_t>(h->root);
+	key_count = h->key_count;
+	key_values = reinterpret_cast<const std::uint32_t *>(edges + edge_count);
+	values = key_values + key_count + 1;
+	value_count = h->value_count;
+	headword_count = h->headword_count;
+	headword_ends = reinterpret_cast<const std::uint64_t *>(key_values + numbers);
+	strings_size = h->strings_size;
+	strings = reinterpret_cast<const char *>(headword_ends + headword_count);
+}
+
+// Checked as they are reached rather than up front, so that opening doesn't read the whole file
+
+const headword_dawg::dawg_node &headword_dawg::node_at(std::uint32_t id) const
+{
+	if (id >= node_count)
+	{
+		throw std::runtime_error("corrupt DAWG of headwords");
+	}
+	return nodes[id];
+}
+
+const headword_dawg::dawg_edge *headword_dawg::edges_of(const dawg_node &n) const
+{
+	if (n.first_edge > edge_count || n.edge_count > edge_count - n.first_edge)
+	{
+		throw std::runtime_error("corrupt DAWG of headwords");
+	}
+	return edges + n.first_edge;
+}
+
+const std::uint32_t *headword_dawg::values_of(std::size_t rank, std::size_t &count) const
+{
+	if (rank >= key_count || key_values[rank] > key_values[rank + 1] || key_values[rank + 1] > value_count)
+	{
+		throw std::runtime_error("corrupt DAWG of headwords");
+	}
+	const std::uint32_t from = key_values[rank];
+	const std::uint32_t to = key_values[rank + 1];
+	count = to - from;
+	return values + from;
+}
+
+std::string headword_dawg::headword(std::uint32_t id) const
+{
+	if (id >= headword_count)
+	{
+		throw std::runtime_error("corrupt DAWG of headwords");
+	}
+	const std::uint64_t from = id ? headword_ends[id - 1] : 0;
+	if (from > headword_ends[id] || headword_ends[id] > strings_size)
+	{
+		throw std::runtime_error("corrupt DAWG of headwords");
+	}
+	return std::string(strings + from, headword_ends[id] - from);
+}
+
+bool headword_dawg::follow(const std::string &key, std::uint32_t &node, std::size_t &rank) const
+{
+	node = root;
+	rank = 0;
+	for (unsigned char byte : key)
+	{
+		const dawg_node &n = node_at(node);
+		const dawg_edge *first = edges_of(n);
+		const dawg_edge *found = std::lower_bound(first, first + n.edge_count, byte, [](const dawg_edge &e, unsigned char b)
+												  { return e.label < b; });
+		if (found == first + n.edge_count || found->label != byte)
+		{
+			return false;
+		}
+
+		// Past the variant ending here, if any, and those under the edges before
+		rank += n.final;
+		for (const dawg_edge *e = first; e != found; ++e)
+		{
+			rank += node_at(e->target).key_count;
+		}
+		node = found->target;
+	}
+	return true;
+}
+
+bool headword_dawg::contains(const std::string &word) const
+{
+	std::uint32_t node;
+	std::size_t rank;
+	return follow(lookup_key(word), node, rank) && node_at(node).final;
+}
+
+std::vector<std::string> headword_dawg::complete(const std::string &prefix, std::size_t limit) const
+{
+	std::string key = lookup_key(prefix);
+	if (!key.empty() && (prefix.back() == ' ' || prefix.back() == '\t'))
+	{
+		key.push_back(' '); // "new " is not completed to "newt"
+	}
+
+	std::vector<std::string> found;
+	std::uint32_t node;
+	std::size_t rank;
+	if (!follow(key, node, rank))
+	{
+		return found;
+	}
+
+	// The variants under the node are the next ones in order
+	const std::size_t end = rank + node_at(node).key_count;
+	if (end > key_count)
+	{
+		throw std::runtime_error("corrupt DAWG of headwords");
+	}
+	std::unordered_set<std::uint32_t> seen;
+	for (; rank < end && found.size() < limit; rank++)
+	{
+		std::size_t count;
+		const std::uint32_t *ids = values_of(rank, count);
+		for (std::size_t i = 0; i < count && found.size() < limit; i++)
+		{
+			if (seen.insert(ids[i]).second)
+			{
+				found.push_back(headword(ids[i]));
+			}
+		}
+	}
+	return found;
+}
+
+std::vector<std::pair<std::string, unsigned>> headword_dawg::fuzzy(const std::string &word, unsigned max_edits, std::size_t limit) const
+{
+	std::vector<std::uint32_t> sought;
+	{
+		std::uint32_t value = 0;
+		int remaining = 0;
+		for (unsigned char byte : lookup_key(word))
+		{
+			if (feed_utf8(value, remaining, byte))
+			{
+				sought.push_back(value);
+			}
+		}
+	}
+	const std::size_t width = sought.size() + 1;
+
+	// Depth first, with a row of distances for each character on the way down
+	struct frame
+	{
+		std::uint32_t node;
+		std::uint32_t next_edge;
+		std::size_t next_rank; // of the first variant under the next edge
+		std::size_t row;	   // in rows
+		bool own_row;		   // or the one above, in the middle of a character
+		std::uint32_t value;   // of the character being read
+		int remaining;		   // bytes of it
+	};
+	std::vector<frame> stack;
+	std::vector<unsigned> rows(width);
+	for (std::size_t j = 0; j < width; j++)
+	{
+		rows[j] = static_cast<unsigned>(j);
+	}
+
+	std::vector<std::pair<unsigned, std::size_t>> matches; // distance and variant
+	auto enter = [&](std::uint32_t id, std::size_t rank, std::size_t row, bool own_row, std::uint32_t value, int remaining)
+	{
+		const dawg_node &n = node_at(id);
+		if (n.final && !remaining && rows[row + width - 1] <= max_edits)
+		{
+			matches.emplace_back(rows[row + width - 1], rank);
+		}
+		stack.push_back(frame{id, 0, rank + n.final, row, own_row, value, remaining});
+	};
+	enter(root, 0, 0, true, 0, 0);
+
+	while (!stack.empty())
+	{
+		frame &top = stack.back();
+		const dawg_node &n = node_at(top.node);
+		if (top.next_edge == n.edge_count)
+		{
+			if (top.own_row)
+			{
+				rows.resize(rows.size() - width);
+			}
+			stack.pop_back();
+			continue;
+		}
+
+		const dawg_edge &e = edges_of(n)[top.next_edge++];
+		const std::size_t rank = top.next_rank;
+		top.next_rank += node_at(e.target).key_count;
+
+		std::uint32_t value = top.value;
+		int remaining = top.remaining;
+		const std::size_t above = top.row;
+		if (!feed_utf8(value, remaining, static_cast<unsigned char>(e.label)))
+		{
+			enter(e.target, rank, above, false, value, remaining);
+			continue;
+		}
+
+		// One more character read: the next row, unless it is too far already
+		const std::size_t row = rows.size();
+		rows.resize(row + width);
+		rows[row] = rows[above] + 1;
+		unsigned nearest = rows[row];
+		for (std::size_t j = 1; j < width; j++)
+		{
+			rows[row + j] = std::min({rows[above + j] + 1, rows[row + j - 1] + 1,
+									  rows[above + j - 1] + (sought[j - 1] != value)});
+			nearest = std::min(nearest, rows[row + j]);
+		}
+		if (nearest > max_edits)
+		{
+			rows.resize(row);
+			continue;
+		}
+		enter(e.target, rank, row, true, 0, 0);
+	}
+
+	std::sort(matches.begin(), matches.end());
+	std::vector<std::pair<std::string, unsigned>> found;
+	std::unordered_set<std::uint32_t> seen;
+	for (std::size_t m = 0; m < matches.size() && found.size() < limit; m++)
+	{
+		std::size_t count;
+		const std::uint32_t *ids = values_of(matches[m].second, count);
+		for (std::size_t i = 0; i < count && found.size() < limit; i++)
+		{
+			if (seen.insert(ids[i]).second)
+			{
+				found.emplace_back(headword(ids[i]), matches[m].first);
+			}
+		}
+	}
+	return found;
+}
+
+std::size_t headword_dawg::build(const std::string &dsl_path, const std::string &dawg_path)
+{
+	dsl_reader reader(dsl_path);
+
+	// Each headword once, however many articles it has
+	std::vector<std::string> headwords;
+	std::unordered_map<std::string, std::uint32_t> headword_ids;
+	std::vector<std::pair<std::string, std::uint32_t>> variants;
+
+	dsl_article article;
+	while (reader.next(article))
+	{
+		for (auto const &headword : article.headwords)
+		{
+			auto inserted = headword_ids.emplace(headword.str(), static_cast<std::uint32_t>(headwords.size()));
+			if (inserted.second)
+			{
+				headwords.push_back(headword.str());
+			}
+			for (auto &variant : headword_variants(headword.data, headword.size))
+			{
+				variants.emplace_back(std::move(variant), inserted.first->second);
+			}
+		}
+	}
+	std::sort(variants.begin(), variants.end());
+	variants.erase(std::unique(variants.begin(), variants.end()), variants.end());
+
+	builder b;
+	std::vector<std::uint32_t> numbers; // where the headwords of each variant start, then the headwords
+	std::vector<std::uint32_t> values;
+	for (std::size_t i = 0; i < variants.size(); i++)
+	{
+		if (!i || variants[i].first != variants[i - 1].first)
+		{
+			b.add(variants[i].first);
+			numbers.push_back(static_cast<std::uint32_t>(values.size()));
+		}
+		values.push_back(variants[i].second);
+	}
+	const std::size_t key_count = numbers.size();
+	numbers.push_back(static_cast<std::uint32_t>(values.size()));
+	numbers.insert(numbers.end(), values.begin(), values.end());
+	if (numbers.size() % 2)
+	{
+		numbers.push_back(0);
+	}
+	const std::uint32_t root = b.finish();
+
+	std::vector<std::uint64_t> headword_ends;
+	std::uint64_t strings_size = 0;
+	for (auto const &headword : headwords)
+	{
+		strings_size += headword.size();
+		headword_ends.push_back(strings_size);
+	}
+
+	std::ofstream out(dawg_path, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		throw std::runtime_error("cannot write " + dawg_path);
+	}
+
+	header h;
+	std::memcpy(h.magic, magic, sizeof(magic));
+	h.node_count = b.nodes.size();
+	h.edge_count = b.edges.size();
+	h.root = root;
+	h.key_count = key_count;
+	h.value_count = values.size();
+	h.headword_count = headwords.size();
+	h.strings_size = strings_size;
+	out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+	out.write(reinterpret_cast<const char *>(b.nodes.data()), b.nodes.size() * sizeof(dawg_node));
+	out.write(reinterpret_cast<const char *>(b.edges.data()), b.edges.size() * sizeof(dawg_edge));
+	out.write(reinterpret_cast<const char *>(numbers.data()), numbers.size() * sizeof(std::uint32_t));
+	out.write(reinterpret_cast<const char *>(headword_ends.data()), headword_ends.size() * sizeof(std::uint64_t));
+	for (auto const &headword : headwords)
+	{
+		out.write(headword.data(), headword.size());
+	}
+
+	if (!out.flush())
+	{
+		throw std::runtime_error("cannot write " + dawg_path);
+	}
+
+	return key_count;
+}
@@ -0,0 +1,205 @@
+#include "dsl.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifndef DSL_NO_ZLIB
+#include <zlib.h>
+#endif
+
+namespace
+{
+	std::uint16_t read_u16(const unsigned char *p)
+	{
+		return p[0] | (p[1] << 8);
+	}
+}
+
+void dictzip_file::read_header(const std::string &path)
+{
+	const unsigned char *data = reinterpret_cast<const unsigned char *>(file.data());
+	const std::size_t size = file.size();
+	const std::runtime_error not_dictzip(path + " is not a dictzip file");
+
+	// ID1 ID2 CM FLG, MTIME, XFL OS
+	if (size < 12 || data[0] != 0x1F || data[1] != 0x8B || data[2] != 8)
+	{
+		throw not_dictzip;
+	}
+	const unsigned char flags = data[3];
+	const unsigned char FHCRC = 2, FEXTRA = 4, FNAME = 8, FCOMMENT = 16;
+	if (!(flags & FEXTRA))
+	{
+		throw not_dictzip;
+	}
+
+	// The extra field: subfields of SI1 SI2 LEN, then LEN bytes
+	std::size_t pos = 12;
+	const std::size_t extra_end = pos + read_u16(data + 10);
+	if (extra_end > size)
+	{
+		throw not_dictzip;
+	}
+	while (pos + 4 <= extra_end)
+	{
+		const std::size_t length = read_u16(data + pos + 2);
+		const unsigned char *field = data + pos + 4;
+		if (pos + 4 + length > extra_end)
+		{
+			throw not_dictzip;
+		}
+
+		// "RA": VER CHLEN CHCNT, then the compressed size of each chunk
+		if (data[pos] == 'R' && data[pos + 1] == 'A' && length >= 6 && read_u16(field) == 1)
+		{
+			const std::size_t count = read_u16(field + 4);
+			if (length < 6 + 2 * count)
+			{
+				throw not_dictzip;
+			}
+			chunk_size = read_u16(field + 2);
+			chunk_offsets.resize(count + 1);
+			for (std::size_t i = 0; i < count; i++)
+			{
+				chunk_offsets[i + 1] = chunk_offsets[i] + read_u16(field + 6 + 2 * i);
+			}
+		}
+		pos += 4 + length;
+	}
+	if (chunk_offsets.empty() || chunk_size == 0)
+	{
+		throw not_dictzip;
+	}
+	pos = extra_end;
+
+	// Zero-terminated file name and comment, then the header CRC
+	for (unsigned char field : {FNAME, FCOMMENT})
+	{
+		if (flags & field)
+		{
+			while (pos < size && data[pos])
+			{
+				pos++;
+			}
+			pos++;
+		}
+	}
+	if (flags & FHCRC)
+	{
+		pos += 2;
+	}
+
+	for (auto &offset : chunk_offsets)
+	{
+		offset += pos;
+	}
+	if (chunk_offsets.back() > size)
+	{
+		throw not_dictzip;
+	}
+}
+
+#ifdef DSL_NO_ZLIB
+std::string dictzip_file::inflate_chunk(std::size_t) const
+{
+	throw std::runtime_error("this build of dsl cannot read dictzip files, as it was made without zlib");
+}
+#else
+std::string dictzip_file::inflate_chunk(std::size_t i) const
+{
+	z_stream stream = z_stream();
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) // Raw deflate, the gzip header is ours to read
+	{
+		throw std::bad_alloc();
+	}
+
+	// Each chunk ends with a full flush, so it can be inflated without the ones before
+	std::string chunk(chunk_size, '\0');
+	stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(file.data() + chunk_offsets[i]));
+	stream.avail_in = static_cast<uInt>(chunk_offsets[i + 1] - chunk_offsets[i]);
+	stream.next_out = reinterpret_cast<Bytef *>(&chunk[0]);
+	stream.avail_out = static_cast<uInt>(chunk.size());
+
+	int result = inflate(&stream, Z_SYNC_FLUSH);
+	chunk.resize(chunk.size() - stream.avail_out);
+	inflateEnd(&stream);
+
+	if (result != Z_OK && result != Z_STREAM_END)
+	{
+		throw std::runtime_error("corrupt dictzip chunk");
+	}
+	return chunk;
+}
+#endif
+
+dictzip_file::chunk_ptr dictzip_file::chunk(std::size_t i)
+{
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		auto found = cached.find(i);
+		if (found != cached.end())
+		{
+			cache.splice(cache.begin(), cache, found->second);
+			return found->second->second;
+		}
+	}
+
+	// Inflated without the lock, so that other threads can use the cache meanwhile
+	chunk_ptr inflated = std::make_shared<const std::string>(inflate_chunk(i));
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	if (!cached.count(i))
+	{
+		cache.emplace_front(i, inflated);
+		cached[i] = cache.begin();
+		if (cache.size() > max_cached_chunks)
+		{
+			cached.erase(cache.back().first);
+			cache.pop_back();
+		}
+	}
+	return inflated;
+}
+
+dictzip_file::dictzip_file(const std::string &path, std::size_t max_cached_chunks)
+	: file(path)
+	, chunk_size(0)
+	, size_(0)
+	, max_cached_chunks(std::max<std::size_t>(max_cached_chunks, 1))
+{
+#ifdef DSL_NO_ZLIB
+	throw std::runtime_error(path + ": this build of dsl cannot read dictzip files, as it was made without zlib");
+#endif
+	read_header(path);
+
+	const std::size_t count = chunk_offsets.size() - 1;
+	if (count > 0)
+	{
+		// Only the last chunk may be short
+		size_ = (count - 1) * chunk_size + chunk(count - 1)->size();
+	}
+}
+
+void dictzip_file::read(std::size_t offset, std::size_t size, std::string &out)
+{
+	if (offset > size_ || size > size_ - offset)
+	{
+		throw std::out_of_range("past the end of the dictzip file");
+	}
+
+	out.clear();
+	out.reserve(size);
+	while (size > 0)
+	{
+		chunk_ptr c = chunk(offset / chunk_size);
+		const std::size_t from = offset % chunk_size;
+		if (from >= c->size())
+		{
+			throw std::runtime_error("corrupt dictzip chunk");
+		}
+		const std::size_t n = std::min(size, c->size() - from);
+		out.append(*c, from, n);
+		offset += n;
+		size -= n;
+	}
+}
@@ -1,9 +1,15 @@
 #pragma once
 
 #include <array>
-#include <sstream>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <regex>
+#include <unordered_map>
 #include <vector>
 
 void ltrim(std::string &s);
@@ -11,78 +17,313 @@ void rtrim(std::string &s);
 void trim(std::string &s);
 std::string html_escape(const std::string &s);
 
-struct node : public std::vector<node>
+/**
+ * @brief Appends s to out with HTML special characters escaped.
+ * @param drop_line_breaks Whether to leave out '\r' and '\n' as well.
+ */
+void html_escape_append(std::string &out, const char *s, std::size_t size, bool drop_line_breaks);
+
+// A fast, non-cryptographic hash; chain calls through seed to hash several pieces
+std::uint64_t hash_bytes(std::uint64_t seed, const char *data, std::size_t size);
+
+unsigned default_thread_count();
+
+/**
+ * @brief Calls body(0) to body(count - 1) on up to threads threads (0 for one per core),
+ * and never more than there are cores or calls. The first exception thrown by body, or
+ * by starting a thread, stops the remaining calls and is rethrown.
+ */
+void parallel_for(std::size_t count, unsigned threads, const std::function<void(std::size_t)> &body);
+
+// Built with -DDSL_STATS (DSL_STATS=1 in the environment of setup.py), the converter counts what it does
+#ifdef DSL_STATS
+const bool stats_enabled = true;
+#else
+const bool stats_enabled = false; // the counting code is compiled out
+#endif
+
+/**
+ * @brief What the converter has done, with the time spent in each stage.
+ */
+struct converter_stats
 {
-	bool is_tag; // false if it's a text node (leaf)
+	enum stage
+	{
+		strip, // dom::remove_unwanted_tags
+		parse, // the rest of dom::load
+		build, // builder::get_html
+		stage_count
+	};
 
-	// For tag nodes
-	std::string tag_name;
-	std::string tag_attrs;
+	std::uint64_t nanoseconds[stage_count];
+	std::uint64_t calls[stage_count];
+	std::uint64_t dsl_bytes;	 // given to dom::load
+	std::uint64_t html_bytes;	 // written by builder::get_html
+	std::uint64_t nodes;		 // in the trees parsed
+	std::uint64_t tags_opened;
+	std::uint64_t tags_closed;
+	std::uint64_t tags_reopened; // moved under an [m] opened inside them
+	std::uint64_t allocations;	 // times a buffer of a tree or a builder had to grow
+	std::uint64_t max_depth;	 // of open tags
 
-	// For text nodes
-	std::string text;
+	void add(const converter_stats &other);
+};
 
-	node(std::string tag_name, std::string tag_attrs) : is_tag(true),
-														tag_name(tag_name),
-														tag_attrs(tag_attrs) {}
+/**
+ * @brief Adds s to the counters of the calling thread. Each thread keeps its own,
+ * behind a lock of its own, so that threads converting do not wait for one another.
+ */
+void record_stats(const converter_stats &s);
 
-	node(std::string text) : is_tag(false),
-							 text(text) {}
+// The counters of all threads, including those gone
+converter_stats collect_stats();
 
-	/**
-	 * @brief Recursively converts the node and its children to a string.
-	 * @return The string representation of the node and its children.
-	 */
-	std::string to_string() const;
+// Zeroes the counters. Conversions under way meanwhile may be counted in part.
+void reset_stats();
 
-	/**
-	 * @brief Traverse root-first, depth-first.
-	 * @return Tag/text.
-	 */
-	std::string traverse(const std::string &representation) const;
+// A whole file mapped read-only into memory
+class mapped_file
+{
+private:
+	const char *data_;
+	std::size_t size_;
 
+public:
 	/**
-	 * @brief Recursively converts the node and its children to a string in XML.
-	 * @return The string representation of the node and its children in XML.
+	 * @throw std::runtime_error if the file cannot be opened or mapped.
 	 */
-	std::string to_xml() const;
+	explicit mapped_file(const std::string &path);
+	~mapped_file();
+
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	const char *data() const { return data_; }
+	std::size_t size() const { return size_; }
 };
 
-class dom
+typedef std::uint32_t node_id; // index in dom::nodes
+
+// A run of characters in dom::chars
+struct span
 {
-private:
-	static const std::regex re_brackets_blocks;
-	static const std::regex re_trn_trs_tags;
-	static const std::regex re_lang_open;
-	static const std::regex re_lang_close;
-	static const std::regex re_com_tags;
-	static const std::regex re_t_tags;		  // transcription
-	static const std::regex re_asterisk_tags; // secondary/optional
-	static std::string remove_unwanted_tags(const std::string &dsl_text);
+	std::uint32_t offset;
+	std::uint32_t size;
+};
+
+// Tags known to the builder, resolved once when the tag is read
+enum class tag_kind : std::uint8_t
+{
+	text, // not a tag at all
+	unknown,
+	b,
+	i,
+	u,
+	apostrophe, // [']
+	sub,
+	sup,
+	c,
+	m,
+	m0, // m0 to m9 must stay contiguous
+	m1,
+	m2,
+	m3,
+	m4,
+	m5,
+	m6,
+	m7,
+	m8,
+	m9,
+	ex,
+	s,
+	video,
+	ref,
+	url,
+	p,
+	br,
+	count
+};
 
-	static std::string preprocess(const std::string &dsl_text);
+tag_kind classify_tag(const char *name, std::size_t size);
 
-	static bool tag_is_m_n(const std::string &name_tag);
-	static bool tag_is_m(const std::string &name_tag);
-	static bool check_m(const std::string &dst, const std::string &src);
+struct node
+{
+	bool is_tag;  // false if it's a text node (leaf)
+	tag_kind tag; // tag_kind::unknown for tags only known by their name
 
-	static void process_unsorted_parts(std::string &str, bool strip);
+	// Links to other nodes. As the root (0) is nobody's child or sibling, 0 also means "none".
+	node_id parent;
+	node_id first_child;
+	node_id last_child;
+	node_id prev_sibling;
+	node_id next_sibling;
+
+	// For tag nodes
+	span tag_name;
+	span tag_attrs;
+
+	// For text nodes
+	span text;
+};
+
+class dom
+{
+private:
+	static bool wraps_line(char const *line, char const *end);
+
+	static bool tag_is_m_n(tag_kind tag);
+	static bool tag_is_m(tag_kind tag);
+	static bool check_m(tag_kind dst, tag_kind src);
 
 	char const *string_pos;
-	char const *line_start_pos;
+	char const *string_end;
+	char const *line_start_pos; // start of a line not yet checked by wraps_line, or nullptr
+	char const *splice_pos;		// rest of an implicit "[m]"/"[/m]" being read, or nullptr
+	bool line_wrapped;			// the current line still needs its implicit "[/m]"
 
 	char ch;
 	bool escaped;
 
-	void open_tag(const std::string &name, const std::string attrs, std::vector<node *> &stack);
-	void close_tag(const std::string &name, std::vector<node *> &stack);
+	node_id parse_root; // what the open tags are under: the root, or a link
+
+	// What is left to parse before a preview is complete
+	static const std::size_t no_limit = static_cast<std::size_t>(-1);
+	std::size_t blocks_left;
+	std::size_t chars_left;
+	bool truncated;
+
+	// Kept from one load to the next, so that their memory is reused
+	std::string cleaned_text; // being parsed
+	std::vector<node_id> open_tags;
+	std::string tag_name;
+	std::string tag_attrs;
+	std::string link_text;
+	// One of each per level of links within links, as process_unsorted_parts can make a new
+	// "<<...>>" in the text of a link. A deque, so that growing it moves none of them.
+	std::deque<std::string> cleaned_link_texts;
+	std::deque<std::vector<node_id>> link_tags; // open within the link being parsed
+	std::size_t link_depth;						 // links being parsed, one within the other
+
+	converter_stats counted; // by the load under way, if stats_enabled
+
+	bool tag_is(const node &n, tag_kind tag, const std::string &name) const;
+
+	span add_chars(const std::string &s);
+	void attach(node_id parent, node_id id);
+	node_id detach_last_child(node_id parent);
+	node_id add_node(node_id parent, const node &n);
+
+	void open_tag(tag_kind tag, const std::string &name, const std::string &attrs, std::vector<node_id> &stack);
+	void close_tag(tag_kind tag, const std::string &name, std::vector<node_id> &stack);
+	void parse_link(node_id link);
+
+	bool ready();
+	char peek();
+	char take();
+	bool next_char(); // false at the end of input
 
-	void next_char();
+	void parse(node_id root, std::vector<node_id> &stack);
+	void parse_text(const char *dsl_text, std::size_t length);
 
 public:
-	node root;
+	/**
+	 * @brief Writes text to result with the markup dom ignores taken out: {{comments}},
+	 * [trn], [trs] (with or without '!'), [com], [t] and [*] tags and their closing
+	 * tags, and [/lang]. The first step of parsing.
+	 */
+	static void remove_unwanted_tags(const char *text, std::size_t size, std::string &result);
 
+	/**
+	 * @brief Takes the braces of "{unsorted parts}" out of str, and with strip the
+	 * parts themselves as well, as for the text of a link or a headword.
+	 */
+	static void process_unsorted_parts(std::string &str, bool strip);
+
+	std::vector<node> nodes; // all nodes in creation order, nodes[0] being the root
+	std::string chars;		 // tag names, attributes and texts of the nodes
+
+	dom(); // empty
+	dom(const char *dsl_text, std::size_t length);
 	dom(const std::string &dsl_text);
+
+	/**
+	 * @brief Parses dsl_text in place of what the tree held, reusing its memory.
+	 */
+	void load(const char *dsl_text, std::size_t length);
+
+	/**
+	 * @brief Parses only the first max_blocks [m] blocks of dsl_text, and only its first
+	 * max_chars characters of text (not counting line breaks), 0 meaning no limit. The rest
+	 * of the article is mostly not even read. Tags still open are closed as usual.
+	 * @return Whether anything was left out.
+	 */
+	bool load_preview(const char *dsl_text, std::size_t length, std::size_t max_blocks, std::size_t max_chars);
+
+	const node &root() const { return nodes[0]; }
+
+	const char *data(const span &s) const { return chars.data() + s.offset; }
+	std::string str(const span &s) const { return chars.substr(s.offset, s.size); }
+
+	/**
+	 * @brief Walks n and everything under it, depth-first, without recursion: open(node)
+	 * is called before the children of each node and close(node) after them, text nodes
+	 * included. If open returns false, the children are skipped.
+	 */
+	template <typename open_function, typename close_function>
+	void walk(const node &n, open_function open, close_function close) const
+	{
+		const node_id start = static_cast<node_id>(&n - nodes.data());
+		node_id id = start;
+		while (true)
+		{
+			const node &current = nodes[id];
+			if (open(current) && current.first_child)
+			{
+				id = current.first_child;
+				continue;
+			}
+
+			// Leave the nodes that are done, up to one with a sibling left
+			while (true)
+			{
+				const node &done = nodes[id];
+				close(done);
+				if (id == start)
+				{
+					return;
+				}
+				if (done.next_sibling)
+				{
+					id = done.next_sibling;
+					break;
+				}
+				id = done.parent;
+			}
+		}
+	}
+
+	/**
+	 * @brief Appends the text of the node and its children, without any markup, to out.
+	 */
+	void append_text(const node &n, std::string &out) const;
+
+	/**
+	 * @brief Converts the node and its children to a string.
+	 * @return The text of the node and its children, without any markup.
+	 */
+	std::string to_string(const node &n) const;
+
+	/**
+	 * @brief Traverse root-first, depth-first.
+	 * @return Tag/text.
+	 */
+	std::string traverse(const node &n, const std::string &representation) const;
+
+	/**
+	 * @brief Converts the node and its children to a string in XML.
+	 * @return The string representation of the node and its children in XML.
+	 */
+	std::string to_xml(const node &n) const;
 };
 
 class builder
@@ -92,40 +333,758 @@ private:
 	static bool is_audio(const std::string &filename);
 	static bool is_video(const std::string &filename);
 
-	static std::string get_node_link(const node &n);
+	std::string get_node_link(const node &n) const;
 
 	const std::string base_url_static_files;
 	const std::string base_url_lookup;
 
 	bool audio_found;
 
-	std::ostringstream html_stream;
+	const dom *tree; // the one being converted
+
+	std::string own_html; // unless given a buffer to write into
+	std::string &html;
 
-	void write_children(const node &n);
+	// Writes the start of a node, or all of it; true if its children are to be written too
+	typedef bool (builder::*opener)(const node &n);
 
-	void node_to_html(const node &n);
+	struct tag_writer
+	{
+		opener open;
+		const char *close; // written after the children
+	};
+	static const std::array<tag_writer, static_cast<std::size_t>(tag_kind::count)> writers;
 
-	void write_text(const node &n);
-	void write_b(const node &n);
-	void write_i(const node &n);
-	void write_u(const node &n); // [u] and [']
-	void write_sub(const node &n);
-	void write_sup(const node &n);
-	void write_colour(const node &n);
-	void write_m(const node &n);
-	void write_m_n(const node &n);
-	void write_example(const node &n);
-	void write_media(const node &n);
-	void write_ref(const node &n);
-	void write_url(const node &n);
-	void write_p(const node &n); // abbr
-	void write_br(const node &n);
-	void write_unknown(const node &n);
+	bool open_b(const node &n);
+	bool open_i(const node &n);
+	bool open_u(const node &n); // [u] and [']
+	bool open_sub(const node &n);
+	bool open_sup(const node &n);
+	bool open_colour(const node &n);
+	bool open_m(const node &n);
+	bool open_m_n(const node &n);
+	bool open_example(const node &n);
+	bool open_media(const node &n);
+	bool open_ref(const node &n);
+	bool open_url(const node &n);
+	bool open_p(const node &n); // abbr
+	bool open_br(const node &n);
+	bool open_unknown(const node &n);
 
 public:
 	std::vector<std::string> resources_name;
 
 	builder(const std::string &base_url_static_files, const std::string &base_url_lookup);
 
-	std::string get_html(const node &root);
+	/**
+	 * @brief Makes the builder write into html, so that its capacity can be reused.
+	 */
+	builder(const std::string &base_url_static_files, const std::string &base_url_lookup, std::string &html);
+
+	/**
+	 * @brief Converts the tree into HTML. A builder can convert any number of
+	 * trees, one after the other, reusing its buffers.
+	 * @return The HTML, which lives in the builder's buffer.
+	 */
+	const std::string &get_html(const dom &tree);
+};
+
+/**
+ * @brief A cache of converted articles, keyed by the DSL text and both base URLs,
+ * that keeps the most recently used ones within a budget of bytes.
+ *
+ * The entries are spread over shards by hash, each with its own lock, so that
+ * threads seldom wait for one another. A budget of 0 turns the cache off.
+ */
+class html_cache
+{
+public:
+	struct result
+	{
+		std::string html;
+		std::vector<std::string> resources_name;
+	};
+
+	struct counters
+	{
+		std::uint64_t hits;
+		std::uint64_t misses;
+		std::uint64_t evictions;
+		std::size_t entries;
+		std::size_t bytes;
+		std::size_t max_bytes;
+	};
+
+private:
+	struct entry
+	{
+		std::uint64_t hash;
+		std::string dsl;
+		std::string base_url_static_files;
+		std::string base_url_lookup;
+		std::shared_ptr<const result> value;
+		std::size_t bytes;
+	};
+
+	// Least recently used entries at the back
+	struct shard
+	{
+		mutable std::mutex mutex;
+		std::list<entry> entries;
+		std::unordered_map<std::uint64_t, std::list<entry>::iterator> by_hash;
+		std::size_t bytes = 0;
+	};
+
+	static const std::size_t shard_count = 16;
+	std::array<shard, shard_count> shards;
+
+	std::atomic<std::size_t> max_bytes;
+	std::atomic<std::uint64_t> hits;
+	std::atomic<std::uint64_t> misses;
+	std::atomic<std::uint64_t> evictions;
+
+	static std::uint64_t hash(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup);
+	void evict(shard &s, std::size_t budget);
+
+public:
+	html_cache();
+
+	bool enabled() const { return max_bytes != 0; }
+
+	/**
+	 * @brief Changes the budget, dropping entries as needed.
+	 */
+	void set_max_bytes(std::size_t bytes);
+	void clear();
+	counters get_counters() const;
+
+	/**
+	 * @return The converted article, or null if it is not in the cache.
+	 */
+	std::shared_ptr<const result> find(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup);
+	void insert(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup, std::shared_ptr<const result> value);
+};
+
+/**
+ * @brief A cache of converted articles in named shared memory, for all the
+ * processes of a host to share.
+ *
+ * The segment is a header followed by a fixed number of slots of a fixed size;
+ * an article goes into the slot picked by the hash of its key and replaces
+ * whatever was there. Every slot is guarded by a sequence lock: a writer makes
+ * the sequence odd while it writes, and a reader takes no lock, keeping what it
+ * copied only if the sequence was even before and unchanged after. Entries are
+ * told apart by a 128-bit hash of their key rather than by the key itself,
+ * which would take more room than the HTML.
+ */
+class shared_html_cache
+{
+public:
+	struct counters
+	{
+		// In this process, so that readers don't all write to one shared line
+		std::uint64_t hits;
+		std::uint64_t misses;
+		std::uint64_t stores;
+		std::size_t slots;
+		std::size_t slot_size;
+	};
+
+private:
+	struct header;
+	struct slot;
+
+	char *memory;
+	std::size_t size_;
+	std::size_t slot_size;
+	std::size_t slot_count;
+
+	std::atomic<std::uint64_t> hits;
+	std::atomic<std::uint64_t> misses;
+	std::atomic<std::uint64_t> stores;
+
+	void unmap();
+	slot &slot_at(std::uint64_t hash) const;
+	static void key_hash(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup, std::uint64_t (&hash)[2]);
+
+public:
+	/**
+	 * @brief Attaches to the segment of that name, creating it if there is none.
+	 * @param size Of the whole segment, in bytes.
+	 * @param slot_size Room for one article: HTML and resource names.
+	 * @throw std::runtime_error if the segment cannot be created or mapped, or
+	 * exists with another size or slot size.
+	 */
+	shared_html_cache(const std::string &name, std::size_t size, std::size_t slot_size);
+	~shared_html_cache();
+
+	shared_html_cache(const shared_html_cache &) = delete;
+	shared_html_cache &operator=(const shared_html_cache &) = delete;
+
+	counters get_counters() const;
+
+	/**
+	 * @return Whether the article was found, and html and resources_name set.
+	 */
+	bool find(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup,
+			  std::string &html, std::vector<std::string> &resources_name);
+
+	// Does nothing if the article doesn't fit in a slot, or the slot is being written
+	void insert(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup,
+				const std::string &html, const std::vector<std::string> &resources_name);
+
+	/**
+	 * @brief Removes the name of a segment; processes attached keep their memory.
+	 */
+	static void remove(const std::string &name);
+};
+
+// A run of characters owned by someone else
+struct text_ref
+{
+	const char *data;
+	std::size_t size;
+
+	std::string str() const { return std::string(data, size); }
+};
+
+/**
+ * @brief A dictzip (.dz) file: gzip, compressed in chunks that can be inflated
+ * on their own, with a table of the chunks in the "RA" extra field.
+ *
+ * Only the chunks covering what is read get inflated; the last few used are kept.
+ * Reading is safe from several threads at once.
+ */
+class dictzip_file
+{
+private:
+	typedef std::shared_ptr<const std::string> chunk_ptr;
+
+	mapped_file file;
+	std::size_t chunk_size;			   // once inflated, except for the last chunk
+	std::vector<std::size_t> chunk_offsets; // in the file, plus the end of the last chunk
+	std::size_t size_;
+
+	// Least recently used chunks at the back
+	std::size_t max_cached_chunks;
+	std::mutex cache_mutex;
+	std::list<std::pair<std::size_t, chunk_ptr>> cache;
+	std::unordered_map<std::size_t, std::list<std::pair<std::size_t, chunk_ptr>>::iterator> cached;
+
+	void read_header(const std::string &path);
+	std::string inflate_chunk(std::size_t i) const;
+	chunk_ptr chunk(std::size_t i);
+
+public:
+	/**
+	 * @param max_cached_chunks How many inflated chunks to keep.
+	 * @throw std::runtime_error if the file cannot be opened or is not dictzip.
+	 */
+	explicit dictzip_file(const std::string &path, std::size_t max_cached_chunks = 8);
+
+	// Inflated
+	std::size_t size() const { return size_; }
+	std::size_t file_size() const { return file.size(); }
+
+	/**
+	 * @brief Replaces out with size inflated bytes from offset.
+	 * @throw std::out_of_range if they go past the end.
+	 */
+	void read(std::size_t offset, std::size_t size, std::string &out);
+};
+
+enum class text_encoding
+{
+	utf8,
+	utf16le,
+	utf16be
+};
+
+/**
+ * @brief Tells the encoding of a .dsl file by its first bytes.
+ * @param bom Set to the size of the byte order mark, 0 if there is none.
+ */
+text_encoding detect_encoding(const char *data, std::size_t size, std::size_t &bom);
+
+// Appends text in the given encoding to out, in UTF-8
+void append_utf8(std::string &out, const char *data, std::size_t size, text_encoding encoding);
+
+// Whether path names a dictzip file, by its ".dz" extension
+bool is_dictzip_path(const std::string &path);
+
+// An article of a .dsl file
+struct dsl_article
+{
+	std::vector<text_ref> headwords; // in UTF-8, as written in the file
+	text_ref body;					 // in UTF-8, the DSL text for dom
+
+	// Where the body lies in the file (in bytes, in the file's encoding)
+	std::size_t offset;
+	std::size_t size;
+};
+
+/**
+ * @brief Reads the articles of a Lingvo .dsl file one by one, mapping the file into memory.
+ *
+ * The encoding is told by the BOM (or the lack of it), and the "#NAME",
+ * "#INDEX_LANGUAGE" and "#CONTENTS_LANGUAGE" header lines are read right away.
+ * Articles in UTF-8 files are given as pieces of the mapped file; UTF-16 ones are
+ * converted into buffers of the reader, which are reused by the next article.
+ * A .dsl.dz file is inflated whole into memory first.
+ */
+class dsl_reader
+{
+private:
+	std::unique_ptr<mapped_file> file;
+	std::string inflated; // of a .dsl.dz file
+	std::size_t file_size_;
+
+	const char *text; // the whole file, inflated
+	const char *begin; // after the BOM
+	const char *end;
+	text_encoding encoding_;
+
+	std::size_t pos; // of the next line to read, from begin
+
+	std::string name_;
+	std::string index_language_;
+	std::string contents_language_;
+
+	// Scratch space for UTF-16 files
+	std::string headword_text;
+	std::vector<std::pair<std::size_t, std::size_t>> headword_ranges;
+	std::string body_text;
+
+	unsigned unit(std::size_t at) const;
+	std::size_t unit_size() const { return encoding_ == text_encoding::utf8 ? 1 : 2; }
+	std::size_t line_end(std::size_t from) const;
+	std::size_t trim_line_end(std::size_t from, std::size_t to) const;
+	bool is_blank(std::size_t from, std::size_t to) const;
+	void append_utf8(std::string &out, std::size_t from, std::size_t to) const
+	{
+		::append_utf8(out, begin + from, to - from, encoding_);
+	}
+
+	void read_header();
+
+public:
+	explicit dsl_reader(const std::string &path);
+
+	text_encoding encoding() const { return encoding_; }
+	const std::string &name() const { return name_; }
+	const std::string &index_language() const { return index_language_; }
+	const std::string &contents_language() const { return contents_language_; }
+
+	/**
+	 * @brief Reads the next article.
+	 * @return false once there are no more articles.
+	 */
+	bool next(dsl_article &article);
+
+	// On disk, compressed for a .dsl.dz file
+	std::size_t file_size() const { return file_size_; }
+
+	/**
+	 * @brief Gets the body of an article from where it lies in the file.
+	 * @return The body in UTF-8, valid until the next call to next or body_at.
+	 */
+	text_ref body_at(std::size_t offset, std::size_t size);
+
+	/**
+	 * @brief The same, safe to call from several threads at once.
+	 * @param buffer Holds the body if it has to be converted from UTF-16.
+	 */
+	text_ref body_at(std::size_t offset, std::size_t size, std::string &buffer) const;
+};
+
+/**
+ * @brief Gets articles of a .dsl or .dsl.dz file from where they lie, as
+ * recorded by dsl_reader, without reading the rest of the file.
+ *
+ * A .dsl.dz file is inflated only around the articles asked for. Safe to use
+ * from several threads at once.
+ */
+class dsl_file
+{
+private:
+	std::unique_ptr<mapped_file> plain;
+	std::unique_ptr<dictzip_file> compressed;
+	std::size_t text_size; // inflated
+	text_encoding encoding_;
+	std::size_t bom;
+
+public:
+	explicit dsl_file(const std::string &path);
+
+	text_encoding encoding() const { return encoding_; }
+	// On disk, compressed for a .dsl.dz file
+	std::size_t file_size() const { return plain ? plain->size() : compressed->file_size(); }
+
+	/**
+	 * @brief Gets the body of an article from where it lies in the file.
+	 * @param buffer Holds the body if it has to be inflated or converted from UTF-16.
+	 * @return The body in UTF-8.
+	 * @throw std::out_of_range if there can't be an article there.
+	 */
+	text_ref body_at(std::size_t offset, std::size_t size, std::string &buffer) const;
+};
+
+/**
+ * @brief Brings a headword into the form it is indexed and looked up in:
+ * "{unsorted parts}" and escaping backslashes dropped, runs of spaces folded
+ * into one, no spaces at either end, and ASCII letters in lower case.
+ */
+std::string normalize_headword(const char *headword, std::size_t size);
+
+/**
+ * @brief Lower-cases UTF-8 text as word_splitter does, for the Latin, Greek,
+ * Cyrillic and Armenian scripts. Bytes that are not UTF-8 are kept as they are.
+ */
+std::string fold_case(const std::string &text);
+
+/**
+ * @brief The forms a headword can be looked up by: with its "{unsorted parts}"
+ * dropped, and each "(optional part)" both kept and left out, up to the first
+ * five of them, normalized as by normalize_headword and lower-cased by fold_case.
+ */
+std::vector<std::string> headword_variants(const char *headword, std::size_t size);
+
+/**
+ * @brief An on-disk index from headwords to the articles of a .dsl file.
+ *
+ * The index file is mapped into memory and searched in place, so opening one
+ * costs the same for any size of dictionary. It holds a header, the entries
+ * sorted by normalized headword, then the headwords themselves.
+ */
+class dsl_index
+{
+public:
+	// Where an article lies in the .dsl file, as in dsl_article
+	struct location
+	{
+		std::uint64_t offset;
+		std::uint64_t size;
+	};
+
+private:
+	struct header
+	{
+		char magic[8];
+		std::uint64_t dsl_size; // to tell if the index is out of date
+		std::uint64_t count;
+	};
+
+	struct entry
+	{
+		std::uint64_t key_offset; // from the end of the entries
+		std::uint64_t key_size;
+		location article;
+	};
+
+	static const char magic[8];
+
+	mapped_file file;
+	const entry *entries;
+	const char *keys;
+	std::size_t keys_size;
+	std::size_t count;
+
+	int compare(const entry &e, const std::string &key) const;
+
+public:
+	/**
+	 * @throw std::runtime_error if the file is not an index, or was built
+	 * from a .dsl file of another size than dsl_size.
+	 */
+	dsl_index(const std::string &path, std::size_t dsl_size);
+
+	std::size_t size() const { return count; }
+
+	/**
+	 * @brief Finds the articles of a headword, in the order of the .dsl file.
+	 */
+	std::vector<location> find(const std::string &headword) const;
+
+	/**
+	 * @brief Indexes every headword of a .dsl file.
+	 * @return The number of entries written.
+	 * @throw std::runtime_error if either file cannot be opened.
+	 */
+	static std::size_t build(const std::string &dsl_path, const std::string &index_path);
+};
+
+/**
+ * @brief Splits UTF-8 text into the words of the full-text index, lower-cased.
+ *
+ * Letters and digits make words, anything else parts them, except for an
+ * apostrophe between letters and a point or comma between digits, as in
+ * "don't" and "3.14". Combining marks (such as stress marks), soft hyphens and
+ * middle dots are dropped, so "соба́ка" and "com·mu·ta·tor" are found as
+ * written without them. Every Chinese character or kana is a word of its own.
+ * Upper case is folded for the Latin, Greek, Cyrillic and Armenian scripts.
+ * Text can be given in pieces, as a word may go on from one text node to the next,
+ * but not with a character cut in two.
+ */
+class word_splitter
+{
+private:
+	std::function<void(const std::string &)> emit;
+	std::string word;
+	char joiner;		// '\'', '.' or ',' after the word, kept if the word goes on
+	bool ends_in_digit; // or else in a letter
+
+	void add_char(std::uint32_t c);
+
+public:
+	explicit word_splitter(std::function<void(const std::string &)> emit);
+
+	void add_text(const char *text, std::size_t size);
+
+	// Ends the word being read, if any, as a line break would
+	void end_word();
 };
+
+/**
+ * @brief An on-disk full-text index of the article bodies of a .dsl file, and of
+ * their headwords, for finding the articles holding all the words of a query.
+ *
+ * The file is mapped into memory and searched in place. It holds a header, then
+ * for each article where it lies in the .dsl file and its headwords, then the
+ * words sorted, each with the number of articles it is in and where their
+ * numbers are, then skips into those numbers, the numbers, and the strings. The numbers
+ * of the articles of a word are sorted and stored as the differences between
+ * them, as varints (seven bits a byte, the high bit set on all bytes but the
+ * last). Every block of skip_interval numbers but the first has a skip, so that
+ * finding a rare word together with a common one doesn't read all of the latter.
+ */
+class search_index
+{
+public:
+	// Where an article lies in the .dsl file, as in dsl_index
+	typedef dsl_index::location location;
+
+private:
+	struct header
+	{
+		char magic[8];
+		std::uint64_t dsl_size; // to tell if the index is out of date
+		std::uint64_t article_count;
+		std::uint64_t term_count;
+		std::uint64_t postings_size;
+		std::uint64_t skip_count;
+		std::uint64_t strings_size;
+	};
+
+	struct article_entry
+	{
+		location article;
+		std::uint64_t headwords_offset; // in the strings
+		std::uint64_t headwords_size;	// each ending in '\n'
+	};
+
+	struct term_entry
+	{
+		std::uint64_t key_offset; // in the strings
+		std::uint32_t key_size;
+		std::uint32_t count; // of articles
+		std::uint64_t postings_offset;
+		std::uint64_t first_skip; // (count - 1) / skip_interval of them
+	};
+
+	struct skip
+	{
+		std::uint32_t id;	  // the last article before the block
+		std::uint32_t offset; // of the block, from the first number of the word
+	};
+
+	static const char magic[8];
+	static const std::uint32_t skip_interval = 128;
+
+	class postings_reader;
+
+	mapped_file file;
+	const article_entry *articles;
+	std::size_t article_count;
+	const term_entry *terms;
+	std::size_t term_count;
+	const unsigned char *postings;
+	std::size_t postings_size;
+	const skip *skips;
+	std::size_t skip_count;
+	const char *strings;
+	std::size_t strings_size;
+
+	const term_entry *find_term(const std::string &word) const;
+	std::size_t postings_end(const term_entry &t) const;
+	const skip *skips_of(const term_entry &t) const;
+
+public:
+	/**
+	 * @throw std::runtime_error if the file is not a full-text index, or was
+	 * built from a .dsl file of another size than dsl_size.
+	 */
+	search_index(const std::string &path, std::size_t dsl_size);
+
+	// Articles are numbered from 0, in the order of the .dsl file
+	std::size_t size() const { return article_count; }
+	std::size_t terms_size() const { return term_count; }
+
+	location article(std::size_t id) const;
+	std::vector<std::string> headwords(std::size_t id) const;
+
+	/**
+	 * @brief Finds the articles holding every word of the query, split as they were indexed.
+	 * @return Their numbers, in order; none for a query without words.
+	 */
+	std::vector<std::uint32_t> find(const std::string &query) const;
+
+	/**
+	 * @brief Indexes the words of every article of a .dsl or .dsl.dz file, as
+	 * left by dom once the markup is gone, on several threads.
+	 * @param threads 0 for one per core.
+	 * @return The number of articles indexed.
+	 * @throw std::runtime_error if either file cannot be opened.
+	 */
+	static std::size_t build(const std::string &dsl_path, const std::string &index_path, unsigned threads);
+};
+
+/**
+ * @brief The headwords of a .dsl file, as a minimal acyclic automaton (a DAWG) of
+ * their variants, for completing prefixes and finding near misses.
+ *
+ * The file is mapped into memory and walked in place. It holds a header, the
+ * nodes, the edges (by byte of UTF-8, sorted within each node), then for each
+ * variant, in sorted order, which headwords it comes from, and the headwords as
+ * written in the .dsl file. Each node records how many variants end below it,
+ * so the variants found under a prefix are numbered consecutively from the
+ * count of those sorting before it, and what they stand for is found with no
+ * further search. Near misses are found by walking the automaton with a row of
+ * the edit distance (in characters) to the word sought, leaving every branch
+ * once no path through it can be close enough.
+ */
+class headword_dawg
+{
+private:
+	struct header
+	{
+		char magic[8];
+		std::uint64_t node_count;
+		std::uint64_t edge_count;
+		std::uint64_t root;
+		std::uint64_t key_count;   // variants
+		std::uint64_t value_count; // the headwords of all the variants together
+		std::uint64_t headword_count;
+		std::uint64_t strings_size;
+	};
+
+	struct dawg_node
+	{
+		std::uint32_t first_edge;
+		std::uint32_t edge_count;
+		std::uint32_t key_count; // ending here or below
+		std::uint32_t final;	 // whether a variant ends here
+	};
+
+	struct dawg_edge
+	{
+		std::uint32_t target;
+		std::uint32_t label; // a byte
+	};
+
+	class builder;
+
+	static const char magic[8];
+
+	mapped_file file;
+	const dawg_node *nodes;
+	std::size_t node_count;
+	const dawg_edge *edges;
+	std::size_t edge_count;
+	std::uint32_t root;
+	std::size_t key_count;
+	const std::uint32_t *key_values;   // key_count + 1 offsets into values
+	const std::uint32_t *values;	   // headword numbers
+	std::size_t value_count;
+	const std::uint64_t *headword_ends; // in the strings
+	std::size_t headword_count;
+	const char *strings;
+	std::size_t strings_size;
+
+	const dawg_node &node_at(std::uint32_t id) const;
+	const dawg_edge *edges_of(const dawg_node &n) const;
+	bool follow(const std::string &key, std::uint32_t &node, std::size_t &rank) const;
+	std::string headword(std::uint32_t id) const;
+	const std::uint32_t *values_of(std::size_t rank, std::size_t &count) const;
+
+public:
+	/**
+	 * @throw std::runtime_error if the file is not a DAWG of headwords.
+	 */
+	explicit headword_dawg(const std::string &path);
+
+	// The variants
+	std::size_t size() const { return key_count; }
+
+	// Whether a headword has a variant that reads as word
+	bool contains(const std::string &word) const;
+
+	/**
+	 * @brief Finds the headwords with a variant starting with prefix.
+	 * @return Up to limit of them, in the order of their variants, each once.
+	 */
+	std::vector<std::string> complete(const std::string &prefix, std::size_t limit) const;
+
+	/**
+	 * @brief Finds the headwords with a variant at most max_edits insertions,
+	 * deletions or replacements of a character away from word.
+	 * @return Up to limit of them with how far they are, the nearest first.
+	 */
+	std::vector<std::pair<std::string, unsigned>> fuzzy(const std::string &word, unsigned max_edits, std::size_t limit) const;
+
+	/**
+	 * @brief Compiles the variants of every headword of a .dsl or .dsl.dz file.
+	 * @return The number of variants.
+	 * @throw std::runtime_error if either file cannot be opened.
+	 */
+	static std::size_t build(const std::string &dsl_path, const std::string &dawg_path);
+};
+
+enum class export_format
+{
+	directory, // an HTML file per article, and index.jsonl
+	blob	   // one file of all the HTML, with an index at the end
+};
+
+struct export_stats
+{
+	std::size_t articles; // written
+	std::size_t failed;	  // left out, as they could not be converted
+	std::size_t dsl_bytes;
+	std::size_t html_bytes;
+	double seconds;
+};
+
+/**
+ * @brief Converts every article of a .dsl or .dsl.dz file into HTML, on all cores.
+ *
+ * A thread reads the file and hands out batches of articles, workers convert
+ * them, and the calling thread writes them out in the order of the file. At
+ * most a few batches per worker are under way at once, so memory stays bounded
+ * whatever the size of the dictionary.
+ *
+ * In a directory, article n goes to "n.html", and "index.jsonl" has a line of
+ * {"file", "headwords", "resources"} for each. A blob starts with "DSLBLOB1"
+ * and two 64-bit numbers, the count of articles and where the index starts,
+ * followed by the HTML of all of them; the index has for each article its
+ * offset and size (64 bits each), its number of headwords and resources
+ * (32 bits each), then those strings, each as a 32-bit size and the bytes.
+ * The blob, or index.jsonl, only takes its name once the export is complete.
+ *
+ * @param threads Workers, 0 for one per core, and never more than cores.
+ * @param progress Called on the calling thread every so often, and at the end;
+ * an exception thrown from it stops the export and is rethrown.
+ * @throw std::runtime_error if a file cannot be read or written.
+ */
+export_stats export_dictionary(const std::string &dsl_path, const std::string &out_path, export_format format,
+							   const std::string &base_url_static_files, const std::string &base_url_lookup,
+							   unsigned threads, const std::function<void(const export_stats &)> &progress);
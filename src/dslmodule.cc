@@ -1,52 +1,1987 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include "dsl.h"
 
+#include <exception>
+#include <new>
+#include <stdexcept>
+
 std::pair<std::string, std::vector<std::string>> to_html(const std::string &dsl, const std::string &base_url_static_files, const std::string &base_url_lookup)
 {
-	dom tree(dsl);
-	builder b(base_url_static_files, base_url_lookup);
-	std::string html = b.get_html(tree.root);
-	return std::make_pair(html, b.resources_name);
+	dom tree(dsl);
+	builder b(base_url_static_files, base_url_lookup);
+	return std::make_pair(b.get_html(tree), b.resources_name);
+}
+
+// Output buffer reused by the conversions on each thread
+static std::string &output_buffer()
+{
+	static thread_local std::string buffer;
+	return buffer;
+}
+
+static void release_output_buffer(std::string &buffer)
+{
+	// Don't let one huge article pin its memory forever
+	const std::size_t max_kept_capacity = 1 << 20;
+	if (buffer.capacity() > max_kept_capacity)
+	{
+		std::string().swap(buffer);
+	}
+}
+
+// The HTML usually takes about twice as many bytes as the DSL
+static std::size_t estimate_html_size(std::size_t dsl_size)
+{
+	return dsl_size * 2 + 64;
+}
+
+// Shared by every conversion, off until set_cache_size is called
+static html_cache cache;
+
+// Shared with other processes once attach_shared_cache is called;
+// read and replaced with the atomic shared_ptr functions, as it may change while converting
+static std::shared_ptr<shared_html_cache> shared_cache;
+
+// Looks the article up in the caches; a hit in the shared one is kept in this process's too
+static bool find_cached(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup,
+						std::string &html, std::vector<std::string> &resources_name)
+{
+	std::shared_ptr<const html_cache::result> cached = cache.find(dsl, size, base_url_static_files, base_url_lookup);
+	if (cached)
+	{
+		html = cached->html;
+		resources_name = cached->resources_name;
+		return true;
+	}
+
+	std::shared_ptr<shared_html_cache> shared = std::atomic_load(&shared_cache);
+	if (!shared || !shared->find(dsl, size, base_url_static_files, base_url_lookup, html, resources_name))
+	{
+		return false;
+	}
+	if (cache.enabled())
+	{
+		cache.insert(dsl, size, base_url_static_files, base_url_lookup,
+					 std::make_shared<const html_cache::result>(html_cache::result{html, resources_name}));
+	}
+	return true;
+}
+
+// Puts a freshly converted article into the caches
+static void store_cached(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup,
+						 const std::string &html, const std::vector<std::string> &resources_name)
+{
+	std::shared_ptr<shared_html_cache> shared = std::atomic_load(&shared_cache);
+	if (shared)
+	{
+		shared->insert(dsl, size, base_url_static_files, base_url_lookup, html, resources_name);
+	}
+	if (cache.enabled())
+	{
+		cache.insert(dsl, size, base_url_static_files, base_url_lookup,
+					 std::make_shared<const html_cache::result>(html_cache::result{html, resources_name}));
+	}
+}
+
+// Converts DSL into html, or takes it from the caches
+static void convert(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup,
+					std::string &html, std::vector<std::string> &resources_name)
+{
+	if (find_cached(dsl, size, base_url_static_files, base_url_lookup, html, resources_name))
+	{
+		return;
+	}
+
+	html.reserve(estimate_html_size(size));
+	dom tree(dsl, size);
+	builder b(base_url_static_files, base_url_lookup, html);
+	b.get_html(tree);
+	resources_name = std::move(b.resources_name);
+
+	store_cached(dsl, size, base_url_static_files, base_url_lookup, html, resources_name);
+}
+
+// str, or bytes for callers that gave bytes
+static PyObject *make_text(const std::string &text, bool as_bytes)
+{
+	if (as_bytes)
+	{
+		return PyBytes_FromStringAndSize(text.data(), text.size());
+	}
+	return PyUnicode_DecodeUTF8(text.data(), text.size(), "strict");
+}
+
+// (html, resources_name) as returned by to_html
+static PyObject *make_result(const std::string &html, const std::vector<std::string> &resources_name, bool as_bytes = false)
+{
+	PyObject *html_str = make_text(html, as_bytes);
+	if (!html_str)
+	{
+		return NULL;
+	}
+
+	PyObject *resources_list = PyList_New(resources_name.size());
+	if (!resources_list)
+	{
+		Py_DECREF(html_str);
+		return NULL;
+	}
+	for (size_t i = 0; i < resources_name.size(); i++)
+	{
+		PyObject *resource_str = make_text(resources_name[i], as_bytes);
+		if (!resource_str)
+		{
+			Py_DECREF(html_str);
+			Py_DECREF(resources_list);
+			return NULL;
+		}
+		PyList_SET_ITEM(resources_list, i, resource_str);
+	}
+
+	PyObject *result_tuple = PyTuple_Pack(2, html_str, resources_list);
+
+	Py_DECREF(html_str);
+	Py_DECREF(resources_list);
+
+	return result_tuple;
+}
+
+/**
+ * @brief Gets the DSL of a str (in UTF-8), or of a bytes-like object as it is,
+ * without copying; release the view with PyBuffer_Release.
+ * @param as_bytes Set if the object is not a str, so that the results should be bytes.
+ */
+static bool get_dsl(PyObject *object, Py_buffer &view, bool &as_bytes)
+{
+	if (PyUnicode_Check(object))
+	{
+		// The UTF-8 is cached in the str, and lives as long as it
+		Py_ssize_t size;
+		const char *data = PyUnicode_AsUTF8AndSize(object, &size);
+		as_bytes = false;
+		return data && PyBuffer_FillInfo(&view, object, const_cast<char *>(data), size, 1, PyBUF_SIMPLE) == 0;
+	}
+
+	if (!PyObject_CheckBuffer(object))
+	{
+		PyErr_Format(PyExc_TypeError, "DSL must be str or a bytes-like object, not %.200s", Py_TYPE(object)->tp_name);
+		return false;
+	}
+	as_bytes = true;
+	return PyObject_GetBuffer(object, &view, PyBUF_SIMPLE) == 0;
+}
+
+// Sets the Python error matching the C++ exception being handled
+static void set_error_from_exception()
+{
+	try
+	{
+		throw;
+	}
+	catch (const std::bad_alloc &)
+	{
+		PyErr_NoMemory();
+	}
+	catch (const std::exception &e)
+	{
+		PyErr_SetString(PyExc_RuntimeError, e.what());
+	}
+}
+
+// Converts the beginning of the article only, bypassing the caches; true if some was left out
+static bool convert_preview(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup,
+							std::size_t max_blocks, std::size_t max_chars, std::string &html, std::vector<std::string> &resources_name)
+{
+	dom tree;
+	bool truncated = tree.load_preview(dsl, size, max_blocks, max_chars);
+	builder b(base_url_static_files, base_url_lookup, html);
+	b.get_html(tree);
+	resources_name = std::move(b.resources_name);
+	return truncated;
+}
+
+static PyObject *to_html_wrapper(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"dsl", "base_url_static_files", "base_url_lookup", "max_blocks", "max_chars", NULL};
+
+	PyObject *dsl;
+	const char *base_url_static_files;
+	const char *base_url_lookup;
+	Py_ssize_t max_blocks = 0;
+	Py_ssize_t max_chars = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oss|$nn", const_cast<char **>(keywords),
+									 &dsl, &base_url_static_files, &base_url_lookup, &max_blocks, &max_chars))
+	{
+		return NULL;
+	}
+	if (max_blocks < 0 || max_chars < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "max_blocks and max_chars must not be negative");
+		return NULL;
+	}
+	const bool preview = max_blocks || max_chars;
+
+	Py_buffer view;
+	bool as_bytes;
+	if (!get_dsl(dsl, view, as_bytes))
+	{
+		return NULL;
+	}
+
+	std::string &html = output_buffer();
+	std::vector<std::string> resources_name;
+	std::string static_files(base_url_static_files);
+	std::string lookup(base_url_lookup);
+
+	bool truncated = false;
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			if (preview)
+			{
+				truncated = convert_preview(static_cast<const char *>(view.buf), view.len, static_files, lookup,
+											max_blocks, max_chars, html, resources_name);
+			}
+			else
+			{
+				convert(static_cast<const char *>(view.buf), view.len, static_files, lookup, html, resources_name);
+			}
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		PyBuffer_Release(&view);
+
+	PyObject *result_tuple = NULL;
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+	}
+	else
+	{
+		result_tuple = make_result(html, resources_name, as_bytes);
+	}
+
+	release_output_buffer(html);
+
+	if (preview && result_tuple)
+	{
+		// (html, resources, truncated)
+		PyObject *with_flag = Py_BuildValue("(OOO)", PyTuple_GET_ITEM(result_tuple, 0), PyTuple_GET_ITEM(result_tuple, 1),
+											truncated ? Py_True : Py_False);
+		Py_DECREF(result_tuple);
+		return with_flag;
+	}
+	return result_tuple;
+}
+
+static PyObject *to_text_wrapper(PyObject *self, PyObject *args)
+{
+	PyObject *dsl;
+
+	if (!PyArg_ParseTuple(args, "O", &dsl))
+	{
+		return NULL;
+	}
+
+	Py_buffer view;
+	bool as_bytes;
+	if (!get_dsl(dsl, view, as_bytes))
+	{
+		return NULL;
+	}
+
+	std::string &text = output_buffer();
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			text.clear();
+			dom tree(static_cast<const char *>(view.buf), view.len);
+			tree.append_text(tree.root(), text);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		PyBuffer_Release(&view);
+
+	PyObject *text_str = NULL;
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+	}
+	else
+	{
+		text_str = make_text(text, as_bytes);
+	}
+
+	release_output_buffer(text);
+
+	return text_str;
+}
+
+static PyObject *to_html_many_wrapper(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"articles", "base_url_static_files", "base_url_lookup", "threads", NULL};
+
+	PyObject *articles;
+	const char *base_url_static_files;
+	const char *base_url_lookup;
+	int threads = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oss|i", const_cast<char **>(keywords),
+									 &articles, &base_url_static_files, &base_url_lookup, &threads))
+	{
+		return NULL;
+	}
+	if (threads < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "threads must not be negative");
+		return NULL;
+	}
+
+	PyObject *sequence = PySequence_Fast(articles, "articles must be a sequence");
+	if (!sequence)
+	{
+		return NULL;
+	}
+
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(sequence);
+	std::vector<Py_buffer> dsl(count);
+	std::vector<char> as_bytes(count);
+	auto release = [&](Py_ssize_t views)
+	{
+		for (Py_ssize_t i = 0; i < views; ++i)
+		{
+			PyBuffer_Release(&dsl[i]);
+		}
+		Py_DECREF(sequence);
+	};
+	for (Py_ssize_t i = 0; i < count; ++i)
+	{
+		bool article_as_bytes;
+		if (!get_dsl(PySequence_Fast_GET_ITEM(sequence, i), dsl[i], article_as_bytes))
+		{
+			release(i);
+			return NULL;
+		}
+		as_bytes[i] = article_as_bytes;
+	}
+
+	std::string static_files(base_url_static_files);
+	std::string lookup(base_url_lookup);
+	std::vector<std::string> html(count);
+	std::vector<std::vector<std::string>> resources_name(count);
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			parallel_for(count, threads, [&](std::size_t i)
+						 { convert(static_cast<const char *>(dsl[i].buf), dsl[i].len, static_files, lookup, html[i], resources_name[i]); });
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		release(count);
+
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+
+	PyObject *results = PyList_New(count);
+	if (!results)
+	{
+		return NULL;
+	}
+	for (Py_ssize_t i = 0; i < count; ++i)
+	{
+		PyObject *result_tuple = make_result(html[i], resources_name[i], as_bytes[i]);
+		if (!result_tuple)
+		{
+			Py_DECREF(results);
+			return NULL;
+		}
+		PyList_SET_ITEM(results, i, result_tuple);
+		std::string().swap(html[i]); // Give memory back as we go
+	}
+
+	return results;
+}
+
+// dsl.Converter: converts one article after another, reusing its memory
+
+struct converter_state
+{
+	const std::string base_url_static_files;
+	const std::string base_url_lookup;
+	const bool use_cache;
+
+	dom tree;
+	std::string html;
+	builder b; // writing into html
+	std::string text;
+
+	std::atomic<bool> busy; // with the GIL released, by one thread
+
+	converter_state(const std::string &base_url_static_files, const std::string &base_url_lookup, bool use_cache)
+		: base_url_static_files(base_url_static_files), base_url_lookup(base_url_lookup), use_cache(use_cache),
+		  b(base_url_static_files, base_url_lookup, html), busy(false) {}
+
+	// Don't let one huge article pin its memory forever
+	void trim(std::size_t dsl_size)
+	{
+		const std::size_t max_kept_size = 1 << 20;
+		if (dsl_size > max_kept_size / 2)
+		{
+			tree = dom();
+		}
+		release_output_buffer(html);
+		release_output_buffer(text);
+	}
+};
+
+typedef struct
+{
+	PyObject_HEAD converter_state *state;
+} ConverterObject;
+
+static PyTypeObject ConverterType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+static PyObject *Converter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"base_url_static_files", "base_url_lookup", "cache", NULL};
+
+	const char *base_url_static_files;
+	const char *base_url_lookup;
+	int use_cache = 1;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|$p", const_cast<char **>(keywords),
+									 &base_url_static_files, &base_url_lookup, &use_cache))
+	{
+		return NULL;
+	}
+
+	ConverterObject *self = reinterpret_cast<ConverterObject *>(type->tp_alloc(type, 0));
+	if (!self)
+	{
+		return NULL;
+	}
+	try
+	{
+		self->state = new converter_state(base_url_static_files, base_url_lookup, use_cache);
+	}
+	catch (...)
+	{
+		set_error_from_exception();
+		Py_DECREF(self);
+		return NULL;
+	}
+	return reinterpret_cast<PyObject *>(self);
+}
+
+static void Converter_dealloc(ConverterObject *self)
+{
+	delete self->state;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+}
+
+// Claims the converter for this call, or sets an error if another thread has it
+static bool Converter_claim(converter_state &state)
+{
+	if (state.busy.exchange(true))
+	{
+		PyErr_SetString(PyExc_RuntimeError, "a Converter can only be used by one thread at a time");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *Converter_convert(ConverterObject *self, PyObject *dsl)
+{
+	converter_state &state = *self->state;
+
+	Py_buffer view;
+	bool as_bytes;
+	if (!get_dsl(dsl, view, as_bytes))
+	{
+		return NULL;
+	}
+	if (!Converter_claim(state))
+	{
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+
+	const char *data = static_cast<const char *>(view.buf);
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			if (!state.use_cache || !find_cached(data, view.len, state.base_url_static_files, state.base_url_lookup, state.html, state.b.resources_name))
+			{
+				state.tree.load(data, view.len);
+				state.html.reserve(estimate_html_size(view.len));
+				state.b.get_html(state.tree);
+				if (state.use_cache)
+				{
+					store_cached(data, view.len, state.base_url_static_files, state.base_url_lookup, state.html, state.b.resources_name);
+				}
+			}
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		PyBuffer_Release(&view);
+
+	PyObject *result_tuple = NULL;
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+	}
+	else
+	{
+		result_tuple = make_result(state.html, state.b.resources_name, as_bytes);
+	}
+
+	state.trim(view.len);
+	state.busy = false;
+	return result_tuple;
+}
+
+static PyObject *Converter_to_text(ConverterObject *self, PyObject *dsl)
+{
+	converter_state &state = *self->state;
+
+	Py_buffer view;
+	bool as_bytes;
+	if (!get_dsl(dsl, view, as_bytes))
+	{
+		return NULL;
+	}
+	if (!Converter_claim(state))
+	{
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			state.tree.load(static_cast<const char *>(view.buf), view.len);
+			state.text.clear();
+			state.tree.append_text(state.tree.root(), state.text);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		PyBuffer_Release(&view);
+
+	PyObject *text_str = NULL;
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+	}
+	else
+	{
+		text_str = make_text(state.text, as_bytes);
+	}
+
+	state.trim(view.len);
+	state.busy = false;
+	return text_str;
+}
+
+static PyMethodDef Converter_methods[] = {
+	{"convert", (PyCFunction)Converter_convert, METH_O, "Convert DSL to HTML, as to_html does"},
+	{"to_text", (PyCFunction)Converter_to_text, METH_O, "Convert DSL to plain text, as dsl.to_text does"},
+	{NULL, NULL, 0, NULL}};
+
+// dsl.Reader: iterates over the articles of a .dsl file
+
+struct reader_state
+{
+	dsl_reader reader;
+	dsl_article article;
+
+	bool convert; // yield HTML instead of the DSL body
+	std::string base_url_static_files;
+	std::string base_url_lookup;
+
+	std::atomic<bool> busy; // reading the next article, by one thread
+
+	reader_state(const std::string &path) : reader(path), convert(false), busy(false) {}
+};
+
+typedef struct
+{
+	PyObject_HEAD reader_state *state;
+} ReaderObject;
+
+static PyTypeObject ReaderType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+static PyObject *make_headwords(const std::vector<text_ref> &headwords)
+{
+	PyObject *list = PyList_New(headwords.size());
+	if (!list)
+	{
+		return NULL;
+	}
+	for (size_t i = 0; i < headwords.size(); i++)
+	{
+		PyObject *headword = PyUnicode_DecodeUTF8(headwords[i].data, headwords[i].size, "strict");
+		if (!headword)
+		{
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, headword);
+	}
+	return list;
+}
+
+static PyObject *Reader_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"path", "base_url_static_files", "base_url_lookup", NULL};
+
+	PyObject *path;
+	const char *base_url_static_files = NULL;
+	const char *base_url_lookup = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|zz", const_cast<char **>(keywords),
+									 PyUnicode_FSConverter, &path, &base_url_static_files, &base_url_lookup))
+	{
+		return NULL;
+	}
+	if (!base_url_static_files != !base_url_lookup)
+	{
+		Py_DECREF(path);
+		PyErr_SetString(PyExc_TypeError, "give both base URLs or neither");
+		return NULL;
+	}
+
+	ReaderObject *self = reinterpret_cast<ReaderObject *>(type->tp_alloc(type, 0));
+	if (!self)
+	{
+		Py_DECREF(path);
+		return NULL;
+	}
+
+	try
+	{
+		self->state = new reader_state(PyBytes_AS_STRING(path));
+		if (base_url_static_files)
+		{
+			self->state->convert = true;
+			self->state->base_url_static_files = base_url_static_files;
+			self->state->base_url_lookup = base_url_lookup;
+		}
+	}
+	catch (const std::runtime_error &e)
+	{
+		PyErr_SetString(PyExc_OSError, e.what());
+	}
+	catch (...)
+	{
+		set_error_from_exception();
+	}
+	Py_DECREF(path);
+
+	if (!self->state)
+	{
+		Py_DECREF(self);
+		return NULL;
+	}
+	return reinterpret_cast<PyObject *>(self);
+}
+
+static void Reader_dealloc(ReaderObject *self)
+{
+	delete self->state;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+}
+
+// Claims the reader for this call, or sets an error if another thread has it
+static bool Reader_claim(reader_state &state)
+{
+	if (state.busy.exchange(true))
+	{
+		PyErr_SetString(PyExc_RuntimeError, "a Reader can only be used by one thread at a time");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *Reader_next_article(reader_state &state)
+{
+	bool found = false;
+	std::string &html = output_buffer();
+	std::vector<std::string> resources_name;
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			found = state.reader.next(state.article);
+			if (found && state.convert)
+			{
+				html.reserve(estimate_html_size(state.article.body.size));
+				dom tree(state.article.body.data, state.article.body.size);
+				builder b(state.base_url_static_files, state.base_url_lookup, html);
+				b.get_html(tree);
+				resources_name = std::move(b.resources_name);
+			}
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+	if (!found)
+	{
+		return NULL; // StopIteration
+	}
+
+	PyObject *headwords = make_headwords(state.article.headwords);
+	if (!headwords)
+	{
+		return NULL;
+	}
+
+	PyObject *result_tuple;
+	if (state.convert)
+	{
+		PyObject *converted = make_result(html, resources_name);
+		release_output_buffer(html);
+		if (!converted)
+		{
+			Py_DECREF(headwords);
+			return NULL;
+		}
+		result_tuple = Py_BuildValue("(NOO)", headwords, PyTuple_GET_ITEM(converted, 0), PyTuple_GET_ITEM(converted, 1));
+		Py_DECREF(converted);
+	}
+	else
+	{
+		result_tuple = Py_BuildValue("(Ns#)", headwords, state.article.body.data, static_cast<Py_ssize_t>(state.article.body.size));
+	}
+	return result_tuple;
+}
+
+static PyObject *Reader_iternext(ReaderObject *self)
+{
+	reader_state &state = *self->state;
+	if (!Reader_claim(state))
+	{
+		return NULL;
+	}
+	PyObject *result_tuple = Reader_next_article(state);
+	state.busy = false;
+	return result_tuple;
+}
+
+static PyObject *Reader_get_name(ReaderObject *self, void *)
+{
+	return PyUnicode_DecodeUTF8(self->state->reader.name().data(), self->state->reader.name().size(), "replace");
+}
+
+static PyObject *Reader_get_index_language(ReaderObject *self, void *)
+{
+	return PyUnicode_DecodeUTF8(self->state->reader.index_language().data(), self->state->reader.index_language().size(), "replace");
+}
+
+static PyObject *Reader_get_contents_language(ReaderObject *self, void *)
+{
+	return PyUnicode_DecodeUTF8(self->state->reader.contents_language().data(), self->state->reader.contents_language().size(), "replace");
+}
+
+static PyObject *Reader_get_encoding(ReaderObject *self, void *)
+{
+	switch (self->state->reader.encoding())
+	{
+	case text_encoding::utf16le:
+		return PyUnicode_FromString("utf-16-le");
+	case text_encoding::utf16be:
+		return PyUnicode_FromString("utf-16-be");
+	default:
+		return PyUnicode_FromString("utf-8");
+	}
+}
+
+static PyGetSetDef Reader_getset[] = {
+	{"name", (getter)Reader_get_name, NULL, "#NAME of the dictionary", NULL},
+	{"index_language", (getter)Reader_get_index_language, NULL, "#INDEX_LANGUAGE of the dictionary", NULL},
+	{"contents_language", (getter)Reader_get_contents_language, NULL, "#CONTENTS_LANGUAGE of the dictionary", NULL},
+	{"encoding", (getter)Reader_get_encoding, NULL, "Encoding of the file", NULL},
+	{NULL, NULL, NULL, NULL, NULL}};
+
+// dsl.Index: looks up articles through an index built by dsl.build_index
+
+struct index_state
+{
+	dsl_file file;
+	dsl_index index;
+
+	bool convert; // give HTML instead of the DSL bodies
+	std::string base_url_static_files;
+	std::string base_url_lookup;
+
+	index_state(const std::string &dsl_path, const std::string &index_path)
+		: file(dsl_path), index(index_path, file.file_size()), convert(false) {}
+};
+
+typedef struct
+{
+	PyObject_HEAD index_state *state;
+} IndexObject;
+
+static PyTypeObject IndexType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+static PyObject *Index_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"dsl_path", "index_path", "base_url_static_files", "base_url_lookup", NULL};
+
+	PyObject *dsl_path;
+	PyObject *index_path;
+	const char *base_url_static_files = NULL;
+	const char *base_url_lookup = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&O&|zz", const_cast<char **>(keywords),
+									 PyUnicode_FSConverter, &dsl_path, PyUnicode_FSConverter, &index_path,
+									 &base_url_static_files, &base_url_lookup))
+	{
+		return NULL;
+	}
+
+	IndexObject *self = NULL;
+	if (!base_url_static_files != !base_url_lookup)
+	{
+		PyErr_SetString(PyExc_TypeError, "give both base URLs or neither");
+	}
+	else if ((self = reinterpret_cast<IndexObject *>(type->tp_alloc(type, 0))))
+	{
+		try
+		{
+			self->state = new index_state(PyBytes_AS_STRING(dsl_path), PyBytes_AS_STRING(index_path));
+			if (base_url_static_files)
+			{
+				self->state->convert = true;
+				self->state->base_url_static_files = base_url_static_files;
+				self->state->base_url_lookup = base_url_lookup;
+			}
+		}
+		catch (const std::runtime_error &e)
+		{
+			PyErr_SetString(PyExc_OSError, e.what());
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+	}
+	Py_DECREF(dsl_path);
+	Py_DECREF(index_path);
+
+	if (self && !self->state)
+	{
+		Py_CLEAR(self);
+	}
+	return reinterpret_cast<PyObject *>(self);
+}
+
+static void Index_dealloc(IndexObject *self)
+{
+	delete self->state;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+}
+
+static PyObject *Index_lookup(IndexObject *self, PyObject *args)
+{
+	const char *headword;
+	Py_ssize_t headword_length;
+
+	if (!PyArg_ParseTuple(args, "s#", &headword, &headword_length))
+	{
+		return NULL;
+	}
+
+	const index_state &state = *self->state;
+	std::vector<std::string> bodies; // or HTML
+	std::vector<std::vector<std::string>> resources_name;
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			std::string buffer;
+			for (auto const &article : state.index.find(std::string(headword, headword_length)))
+			{
+				text_ref body = state.file.body_at(article.offset, article.size, buffer);
+				if (state.convert)
+				{
+					bodies.emplace_back();
+					resources_name.emplace_back();
+					convert(body.data, body.size, state.base_url_static_files, state.base_url_lookup, bodies.back(), resources_name.back());
+				}
+				else
+				{
+					bodies.push_back(body.str());
+				}
+			}
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+
+	PyObject *results = PyList_New(bodies.size());
+	if (!results)
+	{
+		return NULL;
+	}
+	for (size_t i = 0; i < bodies.size(); i++)
+	{
+		PyObject *result = state.convert ? make_result(bodies[i], resources_name[i])
+										 : PyUnicode_DecodeUTF8(bodies[i].c_str(), bodies[i].length(), "strict");
+		if (!result)
+		{
+			Py_DECREF(results);
+			return NULL;
+		}
+		PyList_SET_ITEM(results, i, result);
+	}
+	return results;
+}
+
+static Py_ssize_t Index_length(IndexObject *self)
+{
+	return self->state->index.size();
+}
+
+static int Index_contains(IndexObject *self, PyObject *headword)
+{
+	Py_ssize_t size;
+	const char *data = PyUnicode_Check(headword) ? PyUnicode_AsUTF8AndSize(headword, &size) : NULL;
+	if (!data)
+	{
+		return PyErr_Occurred() ? -1 : 0;
+	}
+	return !self->state->index.find(std::string(data, size)).empty();
+}
+
+static PyMethodDef Index_methods[] = {
+	{"lookup", (PyCFunction)Index_lookup, METH_VARARGS, "Find the articles of a headword"},
+	{NULL, NULL, 0, NULL}};
+
+static PySequenceMethods Index_as_sequence = {
+	(lenfunc)Index_length,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	(objobjproc)Index_contains};
+
+static PyObject *build_index_wrapper(PyObject *self, PyObject *args)
+{
+	PyObject *dsl_path;
+	PyObject *index_path;
+
+	if (!PyArg_ParseTuple(args, "O&O&", PyUnicode_FSConverter, &dsl_path, PyUnicode_FSConverter, &index_path))
+	{
+		return NULL;
+	}
+
+	std::size_t count = 0;
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			count = dsl_index::build(PyBytes_AS_STRING(dsl_path), PyBytes_AS_STRING(index_path));
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		Py_DECREF(dsl_path);
+	Py_DECREF(index_path);
+
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (const std::runtime_error &e)
+		{
+			PyErr_SetString(PyExc_OSError, e.what());
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+
+	return PyLong_FromSize_t(count);
+}
+
+// dsl.SearchIndex: finds articles by the words in them, through an index built by dsl.build_search_index
+
+struct search_state
+{
+	dsl_file file;
+	search_index index;
+
+	bool convert; // give HTML instead of the DSL bodies
+	std::string base_url_static_files;
+	std::string base_url_lookup;
+
+	search_state(const std::string &dsl_path, const std::string &index_path)
+		: file(dsl_path), index(index_path, file.file_size()), convert(false) {}
+};
+
+typedef struct
+{
+	PyObject_HEAD search_state *state;
+} SearchIndexObject;
+
+static PyTypeObject SearchIndexType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+static PyObject *SearchIndex_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"dsl_path", "index_path", "base_url_static_files", "base_url_lookup", NULL};
+
+	PyObject *dsl_path;
+	PyObject *index_path;
+	const char *base_url_static_files = NULL;
+	const char *base_url_lookup = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&O&|zz", const_cast<char **>(keywords),
+									 PyUnicode_FSConverter, &dsl_path, PyUnicode_FSConverter, &index_path,
+									 &base_url_static_files, &base_url_lookup))
+	{
+		return NULL;
+	}
+
+	SearchIndexObject *self = NULL;
+	if (!base_url_static_files != !base_url_lookup)
+	{
+		PyErr_SetString(PyExc_TypeError, "give both base URLs or neither");
+	}
+	else if ((self = reinterpret_cast<SearchIndexObject *>(type->tp_alloc(type, 0))))
+	{
+		try
+		{
+			self->state = new search_state(PyBytes_AS_STRING(dsl_path), PyBytes_AS_STRING(index_path));
+			if (base_url_static_files)
+			{
+				self->state->convert = true;
+				self->state->base_url_static_files = base_url_static_files;
+				self->state->base_url_lookup = base_url_lookup;
+			}
+		}
+		catch (const std::runtime_error &e)
+		{
+			PyErr_SetString(PyExc_OSError, e.what());
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+	}
+	Py_DECREF(dsl_path);
+	Py_DECREF(index_path);
+
+	if (self && !self->state)
+	{
+		Py_CLEAR(self);
+	}
+	return reinterpret_cast<PyObject *>(self);
+}
+
+static void SearchIndex_dealloc(SearchIndexObject *self)
+{
+	delete self->state;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+}
+
+static PyObject *SearchIndex_search(SearchIndexObject *self, PyObject *args)
+{
+	const char *query;
+	Py_ssize_t query_length;
+
+	if (!PyArg_ParseTuple(args, "s#", &query, &query_length))
+	{
+		return NULL;
+	}
+
+	const search_state &state = *self->state;
+	std::vector<std::uint32_t> ids;
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			ids = state.index.find(std::string(query, query_length));
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+
+	PyObject *results = PyList_New(ids.size());
+	if (!results)
+	{
+		return NULL;
+	}
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		PyObject *id = PyLong_FromUnsignedLong(ids[i]);
+		if (!id)
+		{
+			Py_DECREF(results);
+			return NULL;
+		}
+		PyList_SET_ITEM(results, i, id);
+	}
+	return results;
+}
+
+// The number of an article, or -1 with IndexError set
+static Py_ssize_t SearchIndex_article_id(SearchIndexObject *self, PyObject *args)
+{
+	Py_ssize_t id;
+
+	if (!PyArg_ParseTuple(args, "n", &id))
+	{
+		return -1;
+	}
+	if (id < 0 || static_cast<std::size_t>(id) >= self->state->index.size())
+	{
+		PyErr_SetString(PyExc_IndexError, "no article of that number");
+		return -1;
+	}
+	return id;
+}
+
+static PyObject *SearchIndex_headwords(SearchIndexObject *self, PyObject *args)
+{
+	Py_ssize_t id = SearchIndex_article_id(self, args);
+	if (id < 0)
+	{
+		return NULL;
+	}
+
+	std::vector<std::string> headwords;
+	try
+	{
+		headwords = self->state->index.headwords(id);
+	}
+	catch (...)
+	{
+		set_error_from_exception();
+		return NULL;
+	}
+
+	PyObject *results = PyList_New(headwords.size());
+	if (!results)
+	{
+		return NULL;
+	}
+	for (size_t i = 0; i < headwords.size(); i++)
+	{
+		PyObject *headword = PyUnicode_DecodeUTF8(headwords[i].data(), headwords[i].size(), "strict");
+		if (!headword)
+		{
+			Py_DECREF(results);
+			return NULL;
+		}
+		PyList_SET_ITEM(results, i, headword);
+	}
+	return results;
+}
+
+static PyObject *SearchIndex_article(SearchIndexObject *self, PyObject *args)
+{
+	Py_ssize_t id = SearchIndex_article_id(self, args);
+	if (id < 0)
+	{
+		return NULL;
+	}
+
+	const search_state &state = *self->state;
+	std::string body; // or HTML
+	std::vector<std::string> resources_name;
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			std::string buffer;
+			search_index::location article = state.index.article(id);
+			text_ref text = state.file.body_at(article.offset, article.size, buffer);
+			if (state.convert)
+			{
+				convert(text.data, text.size, state.base_url_static_files, state.base_url_lookup, body, resources_name);
+			}
+			else
+			{
+				body = text.str();
+			}
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+
+	return state.convert ? make_result(body, resources_name) : PyUnicode_DecodeUTF8(body.c_str(), body.length(), "strict");
+}
+
+static Py_ssize_t SearchIndex_length(SearchIndexObject *self)
+{
+	return self->state->index.size();
+}
+
+static PyMethodDef SearchIndex_methods[] = {
+	{"search", (PyCFunction)SearchIndex_search, METH_VARARGS, "Find the numbers of the articles holding every word of a query"},
+	{"headwords", (PyCFunction)SearchIndex_headwords, METH_VARARGS, "Get the headwords of an article by its number"},
+	{"article", (PyCFunction)SearchIndex_article, METH_VARARGS, "Get an article by its number"},
+	{NULL, NULL, 0, NULL}};
+
+static PySequenceMethods SearchIndex_as_sequence = {(lenfunc)SearchIndex_length};
+
+static PyObject *build_search_index_wrapper(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"dsl_path", "index_path", "threads", NULL};
+
+	PyObject *dsl_path;
+	PyObject *index_path;
+	int threads = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&O&|i", const_cast<char **>(keywords),
+									 PyUnicode_FSConverter, &dsl_path, PyUnicode_FSConverter, &index_path, &threads))
+	{
+		return NULL;
+	}
+	if (threads < 0)
+	{
+		Py_DECREF(dsl_path);
+		Py_DECREF(index_path);
+		PyErr_SetString(PyExc_ValueError, "threads must not be negative");
+		return NULL;
+	}
+
+	std::size_t count = 0;
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			count = search_index::build(PyBytes_AS_STRING(dsl_path), PyBytes_AS_STRING(index_path), threads);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		Py_DECREF(dsl_path);
+	Py_DECREF(index_path);
+
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (const std::runtime_error &e)
+		{
+			PyErr_SetString(PyExc_OSError, e.what());
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+
+	return PyLong_FromSize_t(count);
+}
+
+// dsl.Dawg: completes and corrects headwords, through a file built by dsl.build_dawg
+
+typedef struct
+{
+	PyObject_HEAD headword_dawg *dawg;
+} DawgObject;
+
+static PyTypeObject DawgType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+static PyObject *Dawg_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"path", NULL};
+
+	PyObject *path;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&", const_cast<char **>(keywords), PyUnicode_FSConverter, &path))
+	{
+		return NULL;
+	}
+
+	DawgObject *self = reinterpret_cast<DawgObject *>(type->tp_alloc(type, 0));
+	if (self)
+	{
+		try
+		{
+			self->dawg = new headword_dawg(PyBytes_AS_STRING(path));
+		}
+		catch (const std::runtime_error &e)
+		{
+			PyErr_SetString(PyExc_OSError, e.what());
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+	}
+	Py_DECREF(path);
+
+	if (self && !self->dawg)
+	{
+		Py_CLEAR(self);
+	}
+	return reinterpret_cast<PyObject *>(self);
+}
+
+static void Dawg_dealloc(DawgObject *self)
+{
+	delete self->dawg;
+	Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
 }
 
-static PyObject *to_html_wrapper(PyObject *self, PyObject *args)
+static PyObject *Dawg_complete(DawgObject *self, PyObject *args, PyObject *kwargs)
 {
-	const char *dsl;
-	const char *base_url_static_files;
-	const char *base_url_lookup;
+	static const char *keywords[] = {"prefix", "limit", NULL};
+
+	const char *prefix;
+	Py_ssize_t prefix_length;
+	Py_ssize_t limit = 10;
 
-	if (!PyArg_ParseTuple(args, "sss", &dsl, &base_url_static_files, &base_url_lookup))
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|n", const_cast<char **>(keywords), &prefix, &prefix_length, &limit))
+	{
+		return NULL;
+	}
+	if (limit < 0)
 	{
+		PyErr_SetString(PyExc_ValueError, "limit must not be negative");
 		return NULL;
 	}
 
-	builder b(base_url_static_files, base_url_lookup);
-	std::string html;
+	std::vector<std::string> headwords;
+	try
+	{
+		headwords = self->dawg->complete(std::string(prefix, prefix_length), limit);
+	}
+	catch (...)
+	{
+		set_error_from_exception();
+		return NULL;
+	}
+
+	PyObject *results = PyList_New(headwords.size());
+	if (!results)
+	{
+		return NULL;
+	}
+	for (size_t i = 0; i < headwords.size(); i++)
+	{
+		PyObject *headword = PyUnicode_DecodeUTF8(headwords[i].data(), headwords[i].size(), "strict");
+		if (!headword)
+		{
+			Py_DECREF(results);
+			return NULL;
+		}
+		PyList_SET_ITEM(results, i, headword);
+	}
+	return results;
+}
+
+static PyObject *Dawg_fuzzy(DawgObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"word", "max_edits", "limit", NULL};
+
+	const char *word;
+	Py_ssize_t word_length;
+	int max_edits = 1;
+	Py_ssize_t limit = 10;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|in", const_cast<char **>(keywords), &word, &word_length, &max_edits, &limit))
+	{
+		return NULL;
+	}
+	if (max_edits < 0 || limit < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "max_edits and limit must not be negative");
+		return NULL;
+	}
+
+	const headword_dawg &dawg = *self->dawg;
+	std::vector<std::pair<std::string, unsigned>> found;
+	std::exception_ptr error;
 
+	// A few edits away from a short word can be much of the dictionary
 	Py_BEGIN_ALLOW_THREADS
-		dom tree(dsl);
-		html = b.get_html(tree.root);
+		try
+		{
+			found = dawg.fuzzy(std::string(word, word_length), max_edits, limit);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
 	Py_END_ALLOW_THREADS
 
-		PyObject *html_str = PyUnicode_DecodeUTF8(html.c_str(), html.length(), "strict");
+		if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
 
-	PyObject *resources_list = PyList_New(b.resources_name.size());
-	for (size_t i = 0; i < b.resources_name.size(); i++)
+	PyObject *results = PyList_New(found.size());
+	if (!results)
 	{
-		PyObject *resource_str = PyUnicode_DecodeUTF8(b.resources_name[i].c_str(), b.resources_name[i].length(), "strict");
-		PyList_SET_ITEM(resources_list, i, resource_str);
+		return NULL;
+	}
+	for (size_t i = 0; i < found.size(); i++)
+	{
+		PyObject *result = Py_BuildValue("(s#I)", found[i].first.data(), static_cast<Py_ssize_t>(found[i].first.size()), found[i].second);
+		if (!result)
+		{
+			Py_DECREF(results);
+			return NULL;
+		}
+		PyList_SET_ITEM(results, i, result);
 	}
+	return results;
+}
 
-	PyObject *result_tuple = PyTuple_Pack(2, html_str, resources_list);
+static Py_ssize_t Dawg_length(DawgObject *self)
+{
+	return self->dawg->size();
+}
 
-	Py_DECREF(html_str);
-	Py_DECREF(resources_list);
+static int Dawg_contains(DawgObject *self, PyObject *word)
+{
+	Py_ssize_t size;
+	const char *data = PyUnicode_Check(word) ? PyUnicode_AsUTF8AndSize(word, &size) : NULL;
+	if (!data)
+	{
+		return PyErr_Occurred() ? -1 : 0;
+	}
+	try
+	{
+		return self->dawg->contains(std::string(data, size));
+	}
+	catch (...)
+	{
+		set_error_from_exception();
+		return -1;
+	}
+}
 
-	return result_tuple;
+static PyMethodDef Dawg_methods[] = {
+	{"complete", (PyCFunction)(void (*)(void))Dawg_complete, METH_VARARGS | METH_KEYWORDS, "Find the headwords starting with a prefix"},
+	{"fuzzy", (PyCFunction)(void (*)(void))Dawg_fuzzy, METH_VARARGS | METH_KEYWORDS, "Find the headwords a few edits away from a word, the nearest first"},
+	{NULL, NULL, 0, NULL}};
+
+static PySequenceMethods Dawg_as_sequence = {
+	(lenfunc)Dawg_length,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	(objobjproc)Dawg_contains};
+
+static PyObject *build_dawg_wrapper(PyObject *self, PyObject *args)
+{
+	PyObject *dsl_path;
+	PyObject *dawg_path;
+
+	if (!PyArg_ParseTuple(args, "O&O&", PyUnicode_FSConverter, &dsl_path, PyUnicode_FSConverter, &dawg_path))
+	{
+		return NULL;
+	}
+
+	std::size_t count = 0;
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			count = headword_dawg::build(PyBytes_AS_STRING(dsl_path), PyBytes_AS_STRING(dawg_path));
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		Py_DECREF(dsl_path);
+	Py_DECREF(dawg_path);
+
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (const std::runtime_error &e)
+		{
+			PyErr_SetString(PyExc_OSError, e.what());
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+
+	return PyLong_FromSize_t(count);
+}
+
+static PyObject *set_cache_size_wrapper(PyObject *self, PyObject *args)
+{
+	Py_ssize_t max_bytes;
+
+	if (!PyArg_ParseTuple(args, "n", &max_bytes))
+	{
+		return NULL;
+	}
+	if (max_bytes < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "max_bytes must not be negative");
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+		cache.set_max_bytes(max_bytes);
+	Py_END_ALLOW_THREADS
+
+		Py_RETURN_NONE;
+}
+
+static PyObject *clear_cache_wrapper(PyObject *self, PyObject *args)
+{
+	Py_BEGIN_ALLOW_THREADS
+		cache.clear();
+	Py_END_ALLOW_THREADS
+
+		Py_RETURN_NONE;
+}
+
+static PyObject *cache_info_wrapper(PyObject *self, PyObject *args)
+{
+	html_cache::counters c = cache.get_counters();
+	return Py_BuildValue("{sKsKsKsnsnsn}",
+						 "hits", static_cast<unsigned long long>(c.hits),
+						 "misses", static_cast<unsigned long long>(c.misses),
+						 "evictions", static_cast<unsigned long long>(c.evictions),
+						 "entries", static_cast<Py_ssize_t>(c.entries),
+						 "bytes", static_cast<Py_ssize_t>(c.bytes),
+						 "max_bytes", static_cast<Py_ssize_t>(c.max_bytes));
+}
+
+static PyObject *stats_wrapper(PyObject *self, PyObject *args)
+{
+	converter_stats s;
+	auto seconds = [&s](converter_stats::stage stage)
+	{ return s.nanoseconds[stage] / 1e9; };
+	auto count = [](std::uint64_t n)
+	{ return static_cast<unsigned long long>(n); };
+
+	Py_BEGIN_ALLOW_THREADS
+		s = collect_stats();
+	Py_END_ALLOW_THREADS
+
+		return Py_BuildValue("{sOsdsdsdsKsKsKsKsKsKsKsKsKsK}",
+						 "enabled", stats_enabled ? Py_True : Py_False,
+						 "strip_seconds", seconds(converter_stats::strip),
+						 "parse_seconds", seconds(converter_stats::parse),
+						 "build_seconds", seconds(converter_stats::build),
+						 "parsed", count(s.calls[converter_stats::parse]),
+						 "built", count(s.calls[converter_stats::build]),
+						 "dsl_bytes", count(s.dsl_bytes),
+						 "html_bytes", count(s.html_bytes),
+						 "nodes", count(s.nodes),
+						 "tags_opened", count(s.tags_opened),
+						 "tags_closed", count(s.tags_closed),
+						 "tags_reopened", count(s.tags_reopened),
+						 "allocations", count(s.allocations),
+						 "max_depth", count(s.max_depth));
+}
+
+static PyObject *reset_stats_wrapper(PyObject *self, PyObject *args)
+{
+	Py_BEGIN_ALLOW_THREADS
+		reset_stats();
+	Py_END_ALLOW_THREADS
+
+		Py_RETURN_NONE;
+}
+
+static PyObject *attach_shared_cache_wrapper(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"name", "size", "slot_size", NULL};
+
+	const char *name;
+	Py_ssize_t size;
+	Py_ssize_t slot_size = 16384;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sn|n", const_cast<char **>(keywords), &name, &size, &slot_size))
+	{
+		return NULL;
+	}
+	if (size < 0 || slot_size < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "sizes must not be negative");
+		return NULL;
+	}
+
+	try
+	{
+		std::atomic_store(&shared_cache, std::make_shared<shared_html_cache>(name, size, slot_size));
+	}
+	catch (const std::runtime_error &e)
+	{
+		PyErr_SetString(PyExc_OSError, e.what());
+		return NULL;
+	}
+	catch (...)
+	{
+		set_error_from_exception();
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *detach_shared_cache_wrapper(PyObject *self, PyObject *args)
+{
+	// Unmapped once the conversions still using it are done
+	std::atomic_store(&shared_cache, std::shared_ptr<shared_html_cache>());
+	Py_RETURN_NONE;
+}
+
+static PyObject *remove_shared_cache_wrapper(PyObject *self, PyObject *args)
+{
+	const char *name;
+
+	if (!PyArg_ParseTuple(args, "s", &name))
+	{
+		return NULL;
+	}
+
+	try
+	{
+		shared_html_cache::remove(name);
+	}
+	catch (const std::runtime_error &e)
+	{
+		PyErr_SetString(PyExc_OSError, e.what());
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *shared_cache_info_wrapper(PyObject *self, PyObject *args)
+{
+	std::shared_ptr<shared_html_cache> shared = std::atomic_load(&shared_cache);
+	if (!shared)
+	{
+		Py_RETURN_NONE;
+	}
+
+	shared_html_cache::counters c = shared->get_counters();
+	return Py_BuildValue("{sKsKsKsnsn}",
+						 "hits", static_cast<unsigned long long>(c.hits),
+						 "misses", static_cast<unsigned long long>(c.misses),
+						 "stores", static_cast<unsigned long long>(c.stores),
+						 "slots", static_cast<Py_ssize_t>(c.slots),
+						 "slot_size", static_cast<Py_ssize_t>(c.slot_size));
+}
+
+// Thrown through C++ code when a Python error is set
+struct python_error
+{
+};
+
+static PyObject *make_export_stats(const export_stats &stats)
+{
+	return Py_BuildValue("{snsnsnsnsdsd}",
+						 "articles", static_cast<Py_ssize_t>(stats.articles),
+						 "failed", static_cast<Py_ssize_t>(stats.failed),
+						 "dsl_bytes", static_cast<Py_ssize_t>(stats.dsl_bytes),
+						 "html_bytes", static_cast<Py_ssize_t>(stats.html_bytes),
+						 "seconds", stats.seconds,
+						 "articles_per_second", stats.seconds > 0 ? stats.articles / stats.seconds : 0.0);
+}
+
+static PyObject *export_wrapper(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"path", "out", "base_url_static_files", "base_url_lookup", "format", "threads", "progress", NULL};
+
+	PyObject *path;
+	PyObject *out;
+	const char *base_url_static_files;
+	const char *base_url_lookup;
+	const char *format_name = "directory";
+	int threads = 0;
+	PyObject *progress = Py_None;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&O&ss|siO", const_cast<char **>(keywords),
+									 PyUnicode_FSConverter, &path, PyUnicode_FSConverter, &out,
+									 &base_url_static_files, &base_url_lookup, &format_name, &threads, &progress))
+	{
+		return NULL;
+	}
+
+	export_format format = export_format::directory;
+	const char *invalid = NULL;
+	if (std::string(format_name) == "blob")
+	{
+		format = export_format::blob;
+	}
+	else if (std::string(format_name) != "directory")
+	{
+		invalid = "format must be 'directory' or 'blob'";
+	}
+	if (threads < 0)
+	{
+		invalid = "threads must not be negative";
+	}
+	if (progress != Py_None && !PyCallable_Check(progress))
+	{
+		invalid = "progress must be callable";
+	}
+	if (invalid)
+	{
+		Py_DECREF(path);
+		Py_DECREF(out);
+		PyErr_SetString(PyExc_ValueError, invalid);
+		return NULL;
+	}
+
+	// Called on this thread, with the GIL released around it
+	std::function<void(const export_stats &)> report;
+	if (progress != Py_None)
+	{
+		report = [progress](const export_stats &stats)
+		{
+			PyGILState_STATE gil = PyGILState_Ensure();
+			PyObject *result = NULL;
+			PyObject *stats_dict = make_export_stats(stats);
+			if (stats_dict)
+			{
+				result = PyObject_CallFunctionObjArgs(progress, stats_dict, NULL);
+				Py_DECREF(stats_dict);
+			}
+			Py_XDECREF(result);
+			PyGILState_Release(gil);
+			if (!result)
+			{
+				throw python_error();
+			}
+		};
+	}
+
+	export_stats stats = {0, 0, 0, 0, 0.0};
+	std::exception_ptr error;
+
+	Py_BEGIN_ALLOW_THREADS
+		try
+		{
+			stats = export_dictionary(PyBytes_AS_STRING(path), PyBytes_AS_STRING(out), format,
+									  base_url_static_files, base_url_lookup, threads, report);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	Py_END_ALLOW_THREADS
+
+		Py_DECREF(path);
+	Py_DECREF(out);
+
+	if (error)
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (const python_error &)
+		{
+		}
+		catch (const std::runtime_error &e)
+		{
+			PyErr_SetString(PyExc_OSError, e.what());
+		}
+		catch (...)
+		{
+			set_error_from_exception();
+		}
+		return NULL;
+	}
+
+	return make_export_stats(stats);
 }
 
 static PyMethodDef DSLMethods[] = {
-	{"to_html", to_html_wrapper, METH_VARARGS, "Convert DSL to HTML"},
+	{"to_html", (PyCFunction)(void (*)(void))to_html_wrapper, METH_VARARGS | METH_KEYWORDS, "Convert DSL to HTML, or only its beginning with max_blocks or max_chars"},
+	{"to_text", to_text_wrapper, METH_VARARGS, "Convert DSL to plain text"},
+	{"to_html_many", (PyCFunction)(void (*)(void))to_html_many_wrapper, METH_VARARGS | METH_KEYWORDS, "Convert a sequence of DSL articles to HTML on several threads"},
+	{"build_index", build_index_wrapper, METH_VARARGS, "Write the headword index of a .dsl file"},
+	{"build_search_index", (PyCFunction)(void (*)(void))build_search_index_wrapper, METH_VARARGS | METH_KEYWORDS, "Write the full-text index of a .dsl file, on several threads"},
+	{"build_dawg", build_dawg_wrapper, METH_VARARGS, "Compile the headwords of a .dsl file, with their variants, into a DAWG"},
+	{"export", (PyCFunction)(void (*)(void))export_wrapper, METH_VARARGS | METH_KEYWORDS, "Convert a whole .dsl file into HTML files or a blob, on several threads"},
+	{"set_cache_size", set_cache_size_wrapper, METH_VARARGS, "Set the budget in bytes of the HTML cache (0 turns it off)"},
+	{"clear_cache", clear_cache_wrapper, METH_NOARGS, "Empty the HTML cache and reset its counters"},
+	{"cache_info", cache_info_wrapper, METH_NOARGS, "Get the counters of the HTML cache"},
+	{"attach_shared_cache", (PyCFunction)(void (*)(void))attach_shared_cache_wrapper, METH_VARARGS | METH_KEYWORDS, "Attach to an HTML cache in shared memory, creating it if needed"},
+	{"detach_shared_cache", detach_shared_cache_wrapper, METH_NOARGS, "Stop using the HTML cache in shared memory"},
+	{"remove_shared_cache", remove_shared_cache_wrapper, METH_VARARGS, "Remove the name of an HTML cache in shared memory"},
+	{"shared_cache_info", shared_cache_info_wrapper, METH_NOARGS, "Get the counters of this process for the shared HTML cache"},
+	{"stats", stats_wrapper, METH_NOARGS, "Get the counters of the converter, if built with DSL_STATS"},
+	{"reset_stats", reset_stats_wrapper, METH_NOARGS, "Zero the counters of the converter"},
 	{NULL, NULL, 0, NULL}};
 
 static struct PyModuleDef dslmodule = {
@@ -58,5 +1993,123 @@ static struct PyModuleDef dslmodule = {
 
 PyMODINIT_FUNC PyInit_dsl(void)
 {
-	return PyModule_Create(&dslmodule);
+	ConverterType.tp_name = "dsl.Converter";
+	ConverterType.tp_basicsize = sizeof(ConverterObject);
+	ConverterType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ConverterType.tp_doc = "Converter(base_url_static_files, base_url_lookup, *, cache=True)\n--\n\n"
+						   "Converts one article after another with the same base URLs, reusing its memory.\n"
+						   "Use one instance per thread.";
+	ConverterType.tp_new = Converter_new;
+	ConverterType.tp_dealloc = (destructor)Converter_dealloc;
+	ConverterType.tp_methods = Converter_methods;
+	if (PyType_Ready(&ConverterType) < 0)
+	{
+		return NULL;
+	}
+
+	ReaderType.tp_name = "dsl.Reader";
+	ReaderType.tp_basicsize = sizeof(ReaderObject);
+	ReaderType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ReaderType.tp_doc = "Reader(path, base_url_static_files=None, base_url_lookup=None)\n--\n\n"
+						"Iterates over the articles of a .dsl file, as (headwords, body) tuples,\n"
+						"or as (headwords, html, resources) tuples if the base URLs are given.";
+	ReaderType.tp_new = Reader_new;
+	ReaderType.tp_dealloc = (destructor)Reader_dealloc;
+	ReaderType.tp_iter = PyObject_SelfIter;
+	ReaderType.tp_iternext = (iternextfunc)Reader_iternext;
+	ReaderType.tp_getset = Reader_getset;
+	if (PyType_Ready(&ReaderType) < 0)
+	{
+		return NULL;
+	}
+
+	IndexType.tp_name = "dsl.Index";
+	IndexType.tp_basicsize = sizeof(IndexObject);
+	IndexType.tp_flags = Py_TPFLAGS_DEFAULT;
+	IndexType.tp_doc = "Index(dsl_path, index_path, base_url_static_files=None, base_url_lookup=None)\n--\n\n"
+					   "Looks up the articles of a .dsl file through an index built by build_index.";
+	IndexType.tp_new = Index_new;
+	IndexType.tp_dealloc = (destructor)Index_dealloc;
+	IndexType.tp_methods = Index_methods;
+	IndexType.tp_as_sequence = &Index_as_sequence;
+	if (PyType_Ready(&IndexType) < 0)
+	{
+		return NULL;
+	}
+
+	SearchIndexType.tp_name = "dsl.SearchIndex";
+	SearchIndexType.tp_basicsize = sizeof(SearchIndexObject);
+	SearchIndexType.tp_flags = Py_TPFLAGS_DEFAULT;
+	SearchIndexType.tp_doc = "SearchIndex(dsl_path, index_path, base_url_static_files=None, base_url_lookup=None)\n--\n\n"
+							 "Finds the articles of a .dsl file by their words, through an index built by build_search_index.";
+	SearchIndexType.tp_new = SearchIndex_new;
+	SearchIndexType.tp_dealloc = (destructor)SearchIndex_dealloc;
+	SearchIndexType.tp_methods = SearchIndex_methods;
+	SearchIndexType.tp_as_sequence = &SearchIndex_as_sequence;
+	if (PyType_Ready(&SearchIndexType) < 0)
+	{
+		return NULL;
+	}
+
+	DawgType.tp_name = "dsl.Dawg";
+	DawgType.tp_basicsize = sizeof(DawgObject);
+	DawgType.tp_flags = Py_TPFLAGS_DEFAULT;
+	DawgType.tp_doc = "Dawg(path)\n--\n\n"
+					  "Completes and corrects headwords through a file built by build_dawg.";
+	DawgType.tp_new = Dawg_new;
+	DawgType.tp_dealloc = (destructor)Dawg_dealloc;
+	DawgType.tp_methods = Dawg_methods;
+	DawgType.tp_as_sequence = &Dawg_as_sequence;
+	if (PyType_Ready(&DawgType) < 0)
+	{
+		return NULL;
+	}
+
+	PyObject *module = PyModule_Create(&dslmodule);
+	if (!module)
+	{
+		return NULL;
+	}
+
+	Py_INCREF(&ReaderType);
+	if (PyModule_AddObject(module, "Reader", reinterpret_cast<PyObject *>(&ReaderType)) < 0)
+	{
+		Py_DECREF(&ReaderType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	Py_INCREF(&ConverterType);
+	if (PyModule_AddObject(module, "Converter", reinterpret_cast<PyObject *>(&ConverterType)) < 0)
+	{
+		Py_DECREF(&ConverterType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	Py_INCREF(&IndexType);
+	if (PyModule_AddObject(module, "Index", reinterpret_cast<PyObject *>(&IndexType)) < 0)
+	{
+		Py_DECREF(&IndexType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	Py_INCREF(&SearchIndexType);
+	if (PyModule_AddObject(module, "SearchIndex", reinterpret_cast<PyObject *>(&SearchIndexType)) < 0)
+	{
+		Py_DECREF(&SearchIndexType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	Py_INCREF(&DawgType);
+	if (PyModule_AddObject(module, "Dawg", reinterpret_cast<PyObject *>(&DawgType)) < 0)
+	{
+		Py_DECREF(&DawgType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	return module;
 }
@@ -0,0 +1,510 @@
+#include "dsl.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <cerrno>
+
+namespace
+{
+	const std::size_t batch_size = 64;		  // articles
+	const std::size_t batches_per_worker = 4; // under way at once
+	const std::chrono::milliseconds progress_interval(250);
+
+	struct export_batch
+	{
+		std::size_t sequence;
+		std::vector<std::vector<std::string>> headwords;
+		std::vector<std::string> bodies;
+		std::vector<std::string> html;
+		std::vector<std::vector<std::string>> resources_name;
+		std::vector<char> failed;
+	};
+
+	typedef std::unique_ptr<export_batch> batch_ptr;
+
+	/**
+	 * @brief Hands the batches from the reading thread to the workers, and from
+	 * them, in order, to the writing thread.
+	 */
+	class export_pipeline
+	{
+	private:
+		std::mutex mutex;
+		std::condition_variable changed;
+
+		std::deque<batch_ptr> to_convert;
+		std::map<std::size_t, batch_ptr> converted;
+		std::size_t under_way; // read but not written yet
+		std::size_t max_under_way;
+		std::size_t batches_read;
+		bool read_all;
+		bool stopping;
+
+	public:
+		explicit export_pipeline(std::size_t max_under_way)
+			: under_way(0), max_under_way(max_under_way), batches_read(0), read_all(false), stopping(false) {}
+
+		// For the reader: waits for room for another batch, false if stopping
+		bool reserve()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [this]()
+						 { return under_way < max_under_way || stopping; });
+			under_way++;
+			return !stopping;
+		}
+
+		void read(batch_ptr batch)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			batch->sequence = batches_read++;
+			to_convert.push_back(std::move(batch));
+			changed.notify_all();
+		}
+
+		void finish_reading()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			read_all = true;
+			changed.notify_all();
+		}
+
+		// For the workers: null once there is nothing left
+		batch_ptr take()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [this]()
+						 { return !to_convert.empty() || read_all || stopping; });
+			if (to_convert.empty() || stopping)
+			{
+				return nullptr;
+			}
+			batch_ptr batch = std::move(to_convert.front());
+			to_convert.pop_front();
+			return batch;
+		}
+
+		void convert_done(batch_ptr batch)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			converted[batch->sequence] = std::move(batch);
+			changed.notify_all();
+		}
+
+		/**
+		 * @brief For the writer: waits a while for the batch of that sequence.
+		 * @param finished Set if there are no more batches.
+		 * @return null if it is not ready yet, or there are no more.
+		 */
+		batch_ptr next(std::size_t sequence, bool &finished)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			auto ready = [&]()
+			{
+				return converted.count(sequence) || (read_all && sequence == batches_read) || stopping;
+			};
+			changed.wait_for(lock, progress_interval, ready);
+
+			finished = stopping || (read_all && sequence == batches_read);
+			auto found = converted.find(sequence);
+			if (finished || found == converted.end())
+			{
+				return nullptr;
+			}
+			batch_ptr batch = std::move(found->second);
+			converted.erase(found);
+			under_way--;
+			changed.notify_all();
+			return batch;
+		}
+
+		void stop()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			changed.notify_all();
+		}
+
+		bool stopped()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return stopping;
+		}
+	};
+
+	void append_json_string(std::string &out, const std::string &s)
+	{
+		static const char hex[] = "0123456789abcdef";
+
+		out.push_back('"');
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\')
+			{
+				out.push_back('\\');
+				out.push_back(c);
+			}
+			else if (static_cast<unsigned char>(c) < 0x20)
+			{
+				out.append("\\u00");
+				out.push_back(hex[c >> 4]);
+				out.push_back(hex[c & 0xF]);
+			}
+			else
+			{
+				out.push_back(c);
+			}
+		}
+		out.push_back('"');
+	}
+
+	void append_json_list(std::string &out, const std::vector<std::string> &list)
+	{
+		out.push_back('[');
+		for (std::size_t i = 0; i < list.size(); i++)
+		{
+			if (i)
+			{
+				out.append(", ");
+			}
+			append_json_string(out, list[i]);
+		}
+		out.push_back(']');
+	}
+
+	template <typename T>
+	void append_number(std::string &out, T n)
+	{
+		out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+	}
+
+	void make_directory(const std::string &path)
+	{
+#ifdef _WIN32
+		int result = _mkdir(path.c_str());
+#else
+		int result = mkdir(path.c_str(), 0755);
+#endif
+		if (result != 0 && errno != EEXIST)
+		{
+			throw std::runtime_error("cannot create " + path);
+		}
+	}
+
+	// Puts a file in place of another, if any
+	void replace_file(const std::string &from, const std::string &to)
+	{
+#ifdef _WIN32
+		std::remove(to.c_str()); // rename does not replace there
+#endif
+		if (std::rename(from.c_str(), to.c_str()) != 0)
+		{
+			throw std::runtime_error("cannot write " + to);
+		}
+	}
+
+	/**
+	 * @brief Writes the articles out, one at a time, in either format. The blob, or
+	 * index.jsonl, is written under a temporary name and only gets its own in finish,
+	 * so that an export that fails half way never looks complete.
+	 */
+	class export_writer
+	{
+	private:
+		export_format format;
+		std::string path;
+		std::string out_name; // the blob, or index.jsonl
+		std::ofstream out;	  // into out_name + ".tmp"
+		std::string index;	  // of the blob, written at the end
+		std::size_t count;
+		std::uint64_t offset;
+		bool finished;
+
+		void check(const std::string &name)
+		{
+			if (!out)
+			{
+				throw std::runtime_error("cannot write " + name);
+			}
+		}
+
+	public:
+		export_writer(const std::string &path, export_format format)
+			: format(format), path(path), count(0), offset(0), finished(false)
+		{
+			if (format == export_format::directory)
+			{
+				make_directory(path);
+				out_name = path + "/index.jsonl";
+				std::remove(out_name.c_str()); // it would list the files of an earlier export
+				out.open(out_name + ".tmp", std::ios::binary | std::ios::trunc);
+				check(out_name);
+			}
+			else
+			{
+				out_name = path;
+				out.open(out_name + ".tmp", std::ios::binary | std::ios::trunc);
+				check(path);
+
+				// Filled in at the end
+				std::string header("DSLBLOB1");
+				append_number<std::uint64_t>(header, 0);
+				append_number<std::uint64_t>(header, 0);
+				out.write(header.data(), header.size());
+				offset = header.size();
+			}
+		}
+
+		void write(const std::vector<std::string> &headwords, const std::string &html, const std::vector<std::string> &resources_name)
+		{
+			if (format == export_format::directory)
+			{
+				const std::string name = std::to_string(count) + ".html";
+				std::ofstream file(path + "/" + name, std::ios::binary | std::ios::trunc);
+				file.write(html.data(), html.size());
+				if (!file.flush())
+				{
+					throw std::runtime_error("cannot write " + path + "/" + name);
+				}
+
+				std::string line("{\"file\": ");
+				append_json_string(line, name);
+				line.append(", \"headwords\": ");
+				append_json_list(line, headwords);
+				line.append(", \"resources\": ");
+				append_json_list(line, resources_name);
+				line.append("}\n");
+				out.write(line.data(), line.size());
+			}
+			else
+			{
+				out.write(html.data(), html.size());
+
+				append_number<std::uint64_t>(index, offset);
+				append_number<std::uint64_t>(index, html.size());
+				append_number<std::uint32_t>(index, headwords.size());
+				append_number<std::uint32_t>(index, resources_name.size());
+				for (auto const *list : {&headwords, &resources_name})
+				{
+					for (auto const &s : *list)
+					{
+						append_number<std::uint32_t>(index, s.size());
+						index.append(s);
+					}
+				}
+				offset += html.size();
+			}
+			count++;
+			check(path);
+		}
+
+		void finish()
+		{
+			if (format == export_format::blob)
+			{
+				out.write(index.data(), index.size());
+				std::string numbers;
+				append_number<std::uint64_t>(numbers, count);
+				append_number<std::uint64_t>(numbers, offset);
+				out.seekp(8);
+				out.write(numbers.data(), numbers.size());
+			}
+			out.close();
+			check(out_name);
+			replace_file(out_name + ".tmp", out_name);
+			finished = true;
+		}
+
+		~export_writer()
+		{
+			if (!finished)
+			{
+				out.close();
+				std::remove((out_name + ".tmp").c_str());
+			}
+		}
+	};
+
+	void read_batches(dsl_reader &reader, export_pipeline &pipeline)
+	{
+		dsl_article article;
+		bool more = true;
+		while (more && pipeline.reserve())
+		{
+			batch_ptr batch(new export_batch());
+			while (batch->bodies.size() < batch_size && (more = reader.next(article)))
+			{
+				batch->headwords.emplace_back();
+				for (auto const &headword : article.headwords)
+				{
+					batch->headwords.back().push_back(headword.str());
+				}
+				batch->bodies.push_back(article.body.str());
+			}
+			pipeline.read(std::move(batch));
+		}
+		pipeline.finish_reading();
+	}
+
+	void convert_batches(export_pipeline &pipeline, const std::string &base_url_static_files, const std::string &base_url_lookup)
+	{
+		while (batch_ptr batch = pipeline.take())
+		{
+			const std::size_t count = batch->bodies.size();
+			batch->html.resize(count);
+			batch->resources_name.resize(count);
+			batch->failed.assign(count, false);
+
+			for (std::size_t i = 0; i < count; i++)
+			{
+				try
+				{
+					dom tree(batch->bodies[i]);
+					builder b(base_url_static_files, base_url_lookup, batch->html[i]);
+					b.get_html(tree);
+					batch->resources_name[i] = std::move(b.resources_name);
+				}
+				catch (const std::bad_alloc &)
+				{
+					throw;
+				}
+				catch (const std::exception &)
+				{
+					batch->failed[i] = true; // Malformed; the rest of the dictionary is still worth having
+				}
+			}
+
+			pipeline.convert_done(std::move(batch));
+		}
+	}
+}
+
+export_stats export_dictionary(const std::string &dsl_path, const std::string &out_path, export_format format,
+							   const std::string &base_url_static_files, const std::string &base_url_lookup,
+							   unsigned threads, const std::function<void(const export_stats &)> &progress)
+{
+	const auto start = std::chrono::steady_clock::now();
+	export_stats stats = {0, 0, 0, 0, 0.0};
+	auto report = [&]()
+	{
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (progress)
+		{
+			progress(stats);
+		}
+	};
+
+	// More workers than cores would only take turns, and would make the queue needlessly long
+	if (!threads || threads > default_thread_count())
+	{
+		threads = default_thread_count();
+	}
+
+	dsl_reader reader(dsl_path);
+	export_writer writer(out_path, format);
+	export_pipeline pipeline(threads * batches_per_worker);
+
+	// The first error of any thread stops them all
+	std::mutex error_mutex;
+	std::exception_ptr error;
+	auto guarded = [&](const std::function<void()> &stage)
+	{
+		try
+		{
+			stage();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(error_mutex);
+			if (!error)
+			{
+				error = std::current_exception();
+			}
+			pipeline.stop();
+		}
+	};
+
+	std::vector<std::thread> stages;
+	try
+	{
+		stages.emplace_back(guarded, [&]()
+							{ read_batches(reader, pipeline); });
+		for (unsigned t = 0; t < threads; t++)
+		{
+			stages.emplace_back(guarded, [&]()
+								{ convert_batches(pipeline, base_url_static_files, base_url_lookup); });
+		}
+	}
+	catch (...)
+	{
+		// The stages already started must be joined before unwinding
+		pipeline.stop();
+		for (std::thread &stage : stages)
+		{
+			stage.join();
+		}
+		throw;
+	}
+
+	guarded([&]()
+			{
+				auto last_report = std::chrono::steady_clock::now();
+				bool finished = false;
+				for (std::size_t sequence = 0; !finished;)
+				{
+					if (batch_ptr batch = pipeline.next(sequence, finished))
+					{
+						for (std::size_t i = 0; i < batch->bodies.size(); i++)
+						{
+							stats.dsl_bytes += batch->bodies[i].size();
+							if (batch->failed[i])
+							{
+								stats.failed++;
+								continue;
+							}
+							writer.write(batch->headwords[i], batch->html[i], batch->resources_name[i]);
+							stats.articles++;
+							stats.html_bytes += batch->html[i].size();
+						}
+						sequence++;
+					}
+
+					if (std::chrono::steady_clock::now() - last_report >= progress_interval)
+					{
+						report();
+						last_report = std::chrono::steady_clock::now();
+					}
+				}
+
+				// Stopped by an error, which is rethrown below: what was written is not the whole dictionary
+				if (!pipeline.stopped())
+				{
+					writer.finish();
+				} });
+
+	for (std::thread &stage : stages)
+	{
+		stage.join();
+	}
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+
+	report();
+	return stats;
+}
@@ -0,0 +1,172 @@
+#include "dsl.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+std::string normalize_headword(const char *headword, std::size_t size)
+{
+	std::string key;
+	key.reserve(size);
+
+	int unsorted_depth = 0;
+	bool space = false;
+	for (std::size_t i = 0; i < size; i++)
+	{
+		char c = headword[i];
+		if (c == '\\' && i + 1 < size)
+		{
+			c = headword[++i];
+		}
+		else if (c == '{')
+		{
+			unsorted_depth++;
+			continue;
+		}
+		else if (c == '}' && unsorted_depth > 0)
+		{
+			unsorted_depth--;
+			continue;
+		}
+
+		if (unsorted_depth > 0)
+		{
+			continue;
+		}
+		if (c == ' ' || c == '\t')
+		{
+			space = !key.empty();
+			continue;
+		}
+
+		if (space)
+		{
+			key.push_back(' ');
+			space = false;
+		}
+		key.push_back(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+	}
+
+	return key;
+}
+
+const char dsl_index::magic[8] = {'D', 'S', 'L', 'I', 'D', 'X', '1', '\0'};
+
+dsl_index::dsl_index(const std::string &path, std::size_t dsl_size)
+	: file(path)
+{
+	const header *h = reinterpret_cast<const header *>(file.data());
+	if (file.size() < sizeof(header) || std::memcmp(h->magic, magic, sizeof(magic)) != 0)
+	{
+		throw std::runtime_error(path + " is not an index");
+	}
+	if (h->dsl_size != dsl_size)
+	{
+		throw std::runtime_error(path + " is out of date");
+	}
+	if (h->count > (file.size() - sizeof(header)) / sizeof(entry))
+	{
+		throw std::runtime_error(path + " is truncated");
+	}
+
+	count = h->count;
+	entries = reinterpret_cast<const entry *>(file.data() + sizeof(header));
+	keys = reinterpret_cast<const char *>(entries + count);
+	keys_size = file.data() + file.size() - keys;
+}
+
+int dsl_index::compare(const entry &e, const std::string &key) const
+{
+	// Checked here rather than up front, so that opening doesn't read the whole index
+	if (e.key_offset > keys_size || e.key_size > keys_size - e.key_offset)
+	{
+		throw std::runtime_error("corrupt index");
+	}
+
+	const std::size_t size = std::min<std::size_t>(e.key_size, key.size());
+	int result = std::memcmp(keys + e.key_offset, key.data(), size);
+	if (result != 0)
+	{
+		return result;
+	}
+	return e.key_size < key.size() ? -1 : e.key_size > key.size() ? 1 : 0;
+}
+
+std::vector<dsl_index::location> dsl_index::find(const std::string &headword) const
+{
+	const std::string key = normalize_headword(headword.data(), headword.size());
+
+	const entry *first = std::lower_bound(entries, entries + count, key, [this](const entry &e, const std::string &k)
+										  { return compare(e, k) < 0; });
+
+	std::vector<location> found;
+	for (const entry *e = first; e != entries + count && compare(*e, key) == 0; ++e)
+	{
+		found.push_back(e->article);
+	}
+	return found;
+}
+
+std::size_t dsl_index::build(const std::string &dsl_path, const std::string &index_path)
+{
+	dsl_reader reader(dsl_path);
+
+	struct pending_entry
+	{
+		std::string key;
+		location article;
+	};
+	std::vector<pending_entry> pending;
+
+	dsl_article article;
+	while (reader.next(article))
+	{
+		for (auto const &headword : article.headwords)
+		{
+			pending_entry e;
+			e.key = normalize_headword(headword.data, headword.size);
+			e.article.offset = article.offset;
+			e.article.size = article.size;
+			pending.push_back(std::move(e));
+		}
+	}
+
+	// Stable, so that the articles of one headword stay in the order of the file
+	std::stable_sort(pending.begin(), pending.end(), [](const pending_entry &a, const pending_entry &b)
+					 { return a.key < b.key; });
+
+	std::ofstream out(index_path, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		throw std::runtime_error("cannot write " + index_path);
+	}
+
+	header h;
+	std::memcpy(h.magic, magic, sizeof(magic));
+	h.dsl_size = reader.file_size();
+	h.count = pending.size();
+	out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+
+	std::uint64_t key_offset = 0;
+	for (auto const &p : pending)
+	{
+		entry e;
+		e.key_offset = key_offset;
+		e.key_size = p.key.size();
+		e.article = p.article;
+		out.write(reinterpret_cast<const char *>(&e), sizeof(e));
+		key_offset += p.key.size();
+	}
+	for (auto const &p : pending)
+	{
+		out.write(p.key.data(), p.key.size());
+	}
+
+	if (!out.flush())
+	{
+		throw std::runtime_error("cannot write " + index_path);
+	}
+
+	return pending.size();
+}
@@ -2,136 +2,342 @@
 
 #include <algorithm>
 #include <cctype>
-#include <numeric>
-#include <stdexcept>
+#include <chrono>
+#include <cstring>
 
-std::string node::to_string() const
+// For the few calls that would crowd the character loop of dom::parse if inlined there
+#ifdef _MSC_VER
+#define DSL_NOINLINE __declspec(noinline)
+#else
+#define DSL_NOINLINE __attribute__((noinline))
+#endif
+
+void dom::append_text(const node &n, std::string &out) const
 {
-	if (!is_tag)
-	{
-		return text;
-	}
-	else
-	{
-		return std::accumulate(this->cbegin(),
-							   this->cend(),
-							   std::string(),
-							   [](std::string &acc, const node &n)
-							   { return acc + n.to_string(); });
-	}
+	walk(
+		n, [this, &out](const node &c)
+		{
+			if (!c.is_tag)
+			{
+				out.append(data(c.text), c.text.size);
+			}
+			return true; },
+		[](const node &) {});
 }
 
-std::string node::traverse(const std::string &representation) const
+std::string dom::to_string(const node &n) const
 {
-	if (!is_tag)
-	{
-		return text;
-	}
-	else
+	std::string result;
+	append_text(n, result);
+	return result;
+}
+
+std::string dom::traverse(const node &n, const std::string &representation) const
+{
+	std::string result;
+	walk(
+		n, [this, &result, &representation](const node &c)
+		{
+			if (!c.is_tag)
+			{
+				result.append(data(c.text), c.text.size);
+			}
+			else
+			{
+				result.append(representation).append("[").append(data(c.tag_name), c.tag_name.size);
+				result.append(" ").append(data(c.tag_attrs), c.tag_attrs.size).append("]");
+			}
+			return true; },
+		[](const node &) {});
+	return result;
+}
+
+std::string dom::to_xml(const node &n) const
+{
+	std::string result;
+	walk(
+		n, [this, &result](const node &c)
+		{
+			if (!c.is_tag)
+			{
+				result.append(data(c.text), c.text.size);
+			}
+			else
+			{
+				result.append("<").append(data(c.tag_name), c.tag_name.size);
+				if (c.tag_attrs.size)
+				{
+					result.append(" ").append(data(c.tag_attrs), c.tag_attrs.size);
+				}
+				result.append(">");
+			}
+			return true; },
+		[this, &result](const node &c)
+		{
+			if (c.is_tag)
+			{
+				result.append("</").append(data(c.tag_name), c.tag_name.size).append(">");
+			} });
+	return result;
+}
+
+namespace
+{
+	/**
+	 * @brief Matches a complete tag at [b, b + len) against the tags dropped by remove_unwanted_tags.
+	 * @return The rank of the tag in the removal order (1 is taken by {{...}} blocks), or 0 if it is not unwanted.
+	 */
+	int unwanted_tag_rank(const char *b, std::size_t len)
 	{
-		std::string result = representation;
-		result += "[" + tag_name + " " + tag_attrs + "]";
-		for (auto const &n : *this)
+		// Skip "[" and the optional "/", drop "]"
+		++b;
+		len -= 2;
+		if (len && *b == '/')
+		{
+			++b;
+			--len;
+		}
+		else if (len == 4 && std::memcmp(b, "lang", 4) == 0)
+		{
+			return 0; // Only [/lang] is removed
+		}
+
+		switch (len)
 		{
-			result += n.traverse(representation);
+		case 1:
+			if (*b == 't')
+				return 5;
+			if (*b == '*')
+				return 6;
+			return 0;
+		case 3:
+			if (std::memcmp(b, "com", 3) == 0)
+				return 4;
+			if (b[0] == 't' && b[1] == 'r' && (b[2] == 'n' || b[2] == 's'))
+				return 2;
+			return 0;
+		case 4:
+			if (std::memcmp(b, "lang", 4) == 0)
+				return 3;
+			if (b[0] == '!' && b[1] == 't' && b[2] == 'r' && (b[3] == 'n' || b[3] == 's'))
+				return 2;
+			return 0;
+		default:
+			return 0;
 		}
-		return result;
 	}
 }
 
-std::string node::to_xml() const
+void dom::remove_unwanted_tags(const char *text, std::size_t size, std::string &result)
 {
-	if (!is_tag)
-	{
-		return text;
-	}
-	else
+	// This used to be a chain of std::regex_replace calls, each removing one kind of tag from
+	// the output of the previous one, in this order:
+	//   1. {{...}} blocks           \{\{[^}]*\}\}
+	//   2. trn/trs tags             \[(/?)(\!?)tr[ns]\]
+	//   3. lang tags (closing only) \[/lang\]
+	//   4. com tags                 \[(/?)com\]
+	//   5. t tags (transcription)   \[(/?)t\]
+	//   6. * tags                   \[(/?)\*\]
+	// Removing something may glue a later kind of tag together (e.g. "[t{{x}}]" becomes "[t]"),
+	// but never the same kind, as regex_replace does not rescan its own output.
+	// To stay byte-for-byte compatible in a single pass, every run of removed characters
+	// remembers the highest rank removed there, and a tag is only dropped if everything
+	// removed from inside it has a lower rank than the tag itself.
+
+	result.clear();
+	result.reserve(size);
+
+	// (position in result, highest rank removed right before that position), sorted by position
+	std::vector<std::pair<std::size_t, int>> removed;
+
+	auto mark_removed = [&result, &removed](int rank)
 	{
-		std::string result = "<" + tag_name;
-		if (tag_attrs.empty())
+		if (!removed.empty() && removed.back().first == result.size())
 		{
-			result += ">";
+			removed.back().second = std::max(removed.back().second, rank);
 		}
 		else
 		{
-			result += " " + tag_attrs + ">";
+			removed.emplace_back(result.size(), rank);
 		}
-		for (const node &n : *this)
+	};
+
+	const std::size_t longest_tag = 7; // [/!trn]
+	std::size_t closing_brace = 0;	   // first '}' at or after the current "{{" contents
+	bool brace_ahead = true;
+
+	for (std::size_t i = 0; i < size;)
+	{
+		char ch = text[i];
+
+		if (ch == '{' && i + 1 < size && text[i + 1] == '{' && brace_ahead)
 		{
-			result += n.to_xml();
-		}
-		result += "</" + tag_name + ">";
-		return result;
-	}
-}
+			if (closing_brace < i + 2)
+			{
+				const void *found = std::memchr(text + i + 2, '}', size - i - 2);
+				if (found)
+				{
+					closing_brace = static_cast<const char *>(found) - text;
+				}
+				else
+				{
+					brace_ahead = false;
+				}
+			}
 
-const std::regex dom::re_brackets_blocks(R"(\{\{[^}]*\}\})");
-const std::regex dom::re_trn_trs_tags(R"(\[(/?)(\!?)tr[ns]\])");
-const std::regex dom::re_lang_open(R"(\[lang[^\]]*\])");
-const std::regex dom::re_lang_close(R"(\[/lang\])");
-const std::regex dom::re_com_tags(R"(\[(/?)com\])");
-const std::regex dom::re_t_tags(R"(\[(/?)t\])");
-const std::regex dom::re_asterisk_tags(R"(\[(/?)\*\])");
+			if (brace_ahead && closing_brace + 1 < size && text[closing_brace + 1] == '}')
+			{
+				mark_removed(1);
+				i = closing_brace + 2;
+				continue;
+			}
+		}
 
-std::string dom::remove_unwanted_tags(const std::string &dsl_text)
-{
-	// Remove {{...}} blocks
-	std::string text = std::regex_replace(dsl_text, re_brackets_blocks, "");
+		result.push_back(ch);
+		++i;
 
-	// Remove trn/trs tags
-	text = std::regex_replace(text, re_trn_trs_tags, "");
+		if (ch != ']')
+		{
+			continue;
+		}
 
-	// Remove lang tags
-	// text = std::regex_replace(text, re_lang_open, "");
-	text = std::regex_replace(text, re_lang_close, "");
+		// Does the output end with an unwanted tag?
 
-	// Remove com tags
-	text = std::regex_replace(text, re_com_tags, "");
+		std::size_t end = result.size();
+		std::size_t start = end - 1;
+		while (start > 0 && end - start < longest_tag && result[start] != '[')
+		{
+			--start;
+		}
+		if (result[start] != '[')
+		{
+			continue;
+		}
 
-	// Remove t tags
-	text = std::regex_replace(text, re_t_tags, "");
+		int rank = unwanted_tag_rank(result.data() + start, end - start);
+		if (!rank)
+		{
+			continue;
+		}
 
-	// Remove * tags
-	text = std::regex_replace(text, re_asterisk_tags, "");
+		int inner_rank = 0;
+		for (auto r = removed.crbegin(); r != removed.crend() && r->first > start; ++r)
+		{
+			inner_rank = std::max(inner_rank, r->second);
+		}
 
-	return text;
+		if (inner_rank < rank)
+		{
+			result.resize(start);
+			while (!removed.empty() && removed.back().first > start)
+			{
+				removed.pop_back();
+			}
+			mark_removed(rank);
+		}
+	}
 }
 
-std::string dom::preprocess(const std::string &dsl_text)
+bool dom::wraps_line(char const *line, char const *end)
 {
-	std::istringstream text_stream(dsl_text);
-	std::ostringstream result_stream;
+	// A line that begins with " [" but not " [m", or with a space not followed by a tag,
+	// is read as if it were wrapped in "[m]...[/m]"
+	std::size_t length = 0;
+	while (length < 3 && line + length != end && line[length] != '\n')
+	{
+		++length;
+	}
 
-	// For each line that begins with " [" but not " [m", or does not begin with a tag, wrap in "[m]...[/m]"
-	std::string line;
-	while (std::getline(text_stream, line))
+	if (length < 2 || line[0] != ' ')
 	{
-		if ((line.size() > 2 && line[0] == ' ' && line[1] == '[' && line[2] != 'm') || (line.size() > 1 && line[0] == ' ' && line[1] != '['))
+		return false;
+	}
+	return line[1] != '[' || (length > 2 && line[2] != 'm');
+}
+
+tag_kind classify_tag(const char *name, std::size_t size)
+{
+	// Switching on the length and then the first character leaves at most one candidate
+	switch (size)
+	{
+	case 1:
+		switch (name[0])
 		{
-			result_stream << "[m]" << line << "[/m]\n";
+		case 'b':
+			return tag_kind::b;
+		case 'i':
+			return tag_kind::i;
+		case 'u':
+			return tag_kind::u;
+		case '\'':
+			return tag_kind::apostrophe;
+		case 'c':
+			return tag_kind::c;
+		case 'm':
+			return tag_kind::m;
+		case 's':
+			return tag_kind::s;
+		case 'p':
+			return tag_kind::p;
 		}
-		else
+		break;
+	case 2:
+		if (name[0] == 'm' && name[1] >= '0' && name[1] <= '9')
 		{
-			result_stream << line << "\n";
+			return static_cast<tag_kind>(static_cast<int>(tag_kind::m0) + (name[1] - '0'));
 		}
+		if (name[0] == 'e' && name[1] == 'x')
+		{
+			return tag_kind::ex;
+		}
+		if (name[0] == 'b' && name[1] == 'r')
+		{
+			return tag_kind::br;
+		}
+		break;
+	case 3:
+		switch (name[0])
+		{
+		case 's':
+			if (name[1] == 'u' && name[2] == 'b')
+				return tag_kind::sub;
+			if (name[1] == 'u' && name[2] == 'p')
+				return tag_kind::sup;
+			break;
+		case 'r':
+			if (name[1] == 'e' && name[2] == 'f')
+				return tag_kind::ref;
+			break;
+		case 'u':
+			if (name[1] == 'r' && name[2] == 'l')
+				return tag_kind::url;
+			break;
+		}
+		break;
+	case 5:
+		if (std::memcmp(name, "video", 5) == 0)
+		{
+			return tag_kind::video;
+		}
+		break;
 	}
 
-	return result_stream.str();
+	return tag_kind::unknown;
 }
 
-bool dom::tag_is_m_n(const std::string &name_tag)
+bool dom::tag_is_m_n(tag_kind tag)
 {
-	return name_tag.size() == 2 && name_tag[0] == 'm' && std::isdigit(name_tag[1]);
+	return tag >= tag_kind::m0 && tag <= tag_kind::m9;
 }
 
-bool dom::tag_is_m(const std::string &name_tag)
+bool dom::tag_is_m(tag_kind tag)
 {
-	return name_tag == "m" || tag_is_m_n(name_tag);
+	return tag == tag_kind::m || tag_is_m_n(tag);
 }
 
-bool dom::check_m(const std::string &dst, const std::string &src)
+bool dom::check_m(tag_kind dst, tag_kind src)
 {
-	return src == "m" && tag_is_m_n(dst);
+	return src == tag_kind::m && tag_is_m_n(dst);
 }
 
 void dom::process_unsorted_parts(std::string &str, bool strip)
@@ -198,94 +404,132 @@ void dom::process_unsorted_parts(std::string &str, bool strip)
 	}
 }
 
-void dom::open_tag(const std::string &name, const std::string attrs, std::vector<node *> &stack)
+bool dom::tag_is(const node &n, tag_kind tag, const std::string &name) const
 {
-	std::vector<node> nodes_to_reopen;
+	// Known tags have exactly one name, only unknown ones need comparing
+	return n.tag == tag &&
+		   (tag != tag_kind::unknown ||
+			(n.tag_name.size == name.size() && chars.compare(n.tag_name.offset, n.tag_name.size, name) == 0));
+}
 
-	if (tag_is_m(name))
+span dom::add_chars(const std::string &s)
+{
+	span result = {static_cast<std::uint32_t>(chars.size()), static_cast<std::uint32_t>(s.size())};
+	chars += s;
+	return result;
+}
+
+void dom::attach(node_id parent, node_id id)
+{
+	nodes[id].parent = parent;
+	node &p = nodes[parent];
+	if (p.last_child)
 	{
-		// All tags above [m] tag will be closed and reopened after
-		// to avoid break this tag by closing some other tag.
+		nodes[id].prev_sibling = p.last_child;
+		nodes[p.last_child].next_sibling = id;
+	}
+	else
+	{
+		p.first_child = id;
+	}
+	p.last_child = id;
+}
 
-		while (!stack.empty())
-		{
-			nodes_to_reopen.emplace_back(std::move(*stack.back()));
+node_id dom::detach_last_child(node_id parent)
+{
+	node &p = nodes[parent];
+	node_id id = p.last_child;
 
-			if (stack.back()->empty())
-			{
-				// Empty nodes are deleted since they're no use
-				stack.pop_back();
-				node *parent = stack.empty() ? &root : stack.back();
-				parent->pop_back();
-			}
-			else
-			{
-				stack.pop_back();
-			}
-		}
+	p.last_child = nodes[id].prev_sibling;
+	if (p.last_child)
+	{
+		nodes[p.last_child].next_sibling = 0;
+	}
+	else
+	{
+		p.first_child = 0;
 	}
+	nodes[id].prev_sibling = 0;
 
+	return id;
+}
+
+node_id dom::add_node(node_id parent, const node &n)
+{
+	node_id id = static_cast<node_id>(nodes.size());
+	nodes.push_back(n);
+	attach(parent, id);
+	return id;
+}
+
+DSL_NOINLINE void dom::open_tag(tag_kind tag, const std::string &name, const std::string &attrs, std::vector<node_id> &stack)
+{
 	// Add tag
 
-	node n(name, attrs);
+	node n = node();
+	n.is_tag = true;
+	n.tag = tag;
+	n.tag_name = add_chars(name);
+	n.tag_attrs = add_chars(attrs);
 
-	if (stack.empty())
+	if (tag_is_m(tag) && !stack.empty())
 	{
-		root.push_back(n);
-		stack.push_back(&root.back());
+		// All tags above [m] tag will be closed and reopened after
+		// to avoid break this tag by closing some other tag.
+		// Each open tag is the last child of the one below it, so moving the
+		// bottom one under [m], with everything it holds, moves them all.
+
+		node_id bottom = detach_last_child(parse_root);
+		node_id id = add_node(parse_root, n);
+		attach(id, bottom);
+		stack.insert(stack.begin(), id);
 	}
 	else
 	{
-		stack.back()->push_back(n);
-		stack.push_back(&stack.back()->back());
+		stack.push_back(add_node(stack.empty() ? parse_root : stack.back(), n));
 	}
 
-	// Reopen tags if needed
-
-	while (!nodes_to_reopen.empty())
+	if (stats_enabled)
 	{
-		if (stack.empty())
-		{
-			root.push_back(std::move(nodes_to_reopen.back()));
-			stack.push_back(&root.back());
-		}
-		else
-		{
-			stack.back()->push_back(std::move(nodes_to_reopen.back()));
-			stack.push_back(&stack.back()->back());
-		}
-
-		nodes_to_reopen.pop_back();
+		counted.tags_opened++;
+		counted.tags_reopened += tag_is_m(tag) ? stack.size() - 1 : 0; // all above the [m]
+		counted.max_depth = std::max<std::uint64_t>(counted.max_depth, stack.size());
 	}
 }
 
-void dom::close_tag(const std::string &name, std::vector<node *> &stack)
+void dom::close_tag(tag_kind tag, const std::string &name, std::vector<node_id> &stack)
 {
 	// Find the tag to be closed
-	std::vector<node *>::reverse_iterator n = std::find_if(
+	std::vector<node_id>::reverse_iterator n = std::find_if(
 		stack.rbegin(),
 		stack.rend(),
-		[this, &name](const node *n)
-		{ return n->tag_name == name || this->check_m(n->tag_name, name); });
+		[this, tag, &name](node_id n)
+		{ return tag_is(nodes[n], tag, name) || check_m(nodes[n].tag, tag); });
 	if (n != stack.rend())
 	{
+		if (stats_enabled)
+		{
+			counted.tags_closed++;
+		}
+
 		// If there is a corresponding tag, close all tags above it,
 		// then close the tag itself
 
 		while (!stack.empty())
 		{
-			bool found = stack.back()->tag_name == name || check_m(stack.back()->tag_name, name);
+			const node &top = nodes[stack.back()];
+			bool found = tag_is(top, tag, name) || check_m(top.tag, tag);
+			bool empty = !top.first_child && top.tag != tag_kind::br;
 
-			if (stack.back()->empty() && stack.back()->tag_name != "br")
+			stack.pop_back();
+			if (empty)
 			{
 				// Empty nodes except [br] tag are deleted since they're no use
-				stack.pop_back();
-				node *parent = stack.empty() ? &root : stack.back();
-				parent->pop_back();
-			}
-			else
-			{
-				stack.pop_back();
+				node_id id = detach_last_child(stack.empty() ? parse_root : stack.back());
+				if (id == nodes.size() - 1)
+				{
+					nodes.pop_back();
+				}
 			}
 
 			if (found)
@@ -296,28 +540,131 @@ void dom::close_tag(const std::string &name, std::vector<node *> &stack)
 	}
 }
 
-void dom::next_char()
+void dom::parse_link(node_id link)
+{
+	// The text of a link is read as an article of its own, in place of the rest of the
+	// article. Taking out its {unsorted parts} may have joined a new "<<...>>", and the
+	// link found there is parsed one level deeper, with a buffer and a stack of its own.
+	char const *const saved_string_pos = string_pos;
+	char const *const saved_string_end = string_end;
+	char const *const saved_line_start_pos = line_start_pos;
+	char const *const saved_splice_pos = splice_pos;
+	const bool saved_line_wrapped = line_wrapped;
+	const node_id saved_parse_root = parse_root;
+
+	if (link_depth == cleaned_link_texts.size())
+	{
+		cleaned_link_texts.emplace_back();
+		link_tags.emplace_back();
+	}
+	std::string &cleaned_link_text = cleaned_link_texts[link_depth];
+	std::vector<node_id> &tags = link_tags[link_depth];
+
+	remove_unwanted_tags(link_text.data(), link_text.size(), cleaned_link_text);
+	string_pos = cleaned_link_text.data();
+	string_end = string_pos + cleaned_link_text.size();
+	line_start_pos = string_pos;
+	splice_pos = nullptr;
+	line_wrapped = false;
+
+	++link_depth;
+	parse(link, tags);
+	--link_depth;
+
+	string_pos = saved_string_pos;
+	string_end = saved_string_end;
+	line_start_pos = saved_line_start_pos;
+	splice_pos = saved_splice_pos;
+	line_wrapped = saved_line_wrapped;
+	parse_root = saved_parse_root;
+}
+
+bool dom::ready()
+{
+	if (splice_pos && *splice_pos)
+	{
+		return true;
+	}
+	splice_pos = nullptr;
+
+	if (line_start_pos)
+	{
+		// First character of a line: decide whether it gets an implicit [m]
+		if (string_pos == string_end)
+		{
+			return false;
+		}
+
+		line_wrapped = wraps_line(line_start_pos, string_end);
+		line_start_pos = nullptr;
+		if (line_wrapped)
+		{
+			splice_pos = "[m]";
+			return true;
+		}
+	}
+
+	if (string_pos == string_end || *string_pos == '\n')
+	{
+		if (line_wrapped)
+		{
+			line_wrapped = false;
+			splice_pos = "[/m]";
+		}
+		else if (string_pos == string_end)
+		{
+			splice_pos = "\n"; // The last line is terminated too
+		}
+	}
+
+	return true;
+}
+
+char dom::peek()
+{
+	if (!ready())
+	{
+		return '\0';
+	}
+	return splice_pos ? *splice_pos : *string_pos;
+}
+
+char dom::take()
 {
-	if (!*string_pos)
-		throw std::exception(); // Not exactly an exception, but we need to break out of the loop
-	ch = *string_pos++;
+	char c = splice_pos ? *splice_pos++ : *string_pos++;
+	if (c == '\n')
+	{
+		line_start_pos = string_pos;
+	}
+	return c;
+}
+
+bool dom::next_char()
+{
+	if (!ready())
+	{
+		return false;
+	}
+	ch = take();
 
 	if (ch == '\\')
 	{
-		if (!*string_pos)
-			throw std::exception(); // ditto
+		if (!ready())
+		{
+			return false;
+		}
 
-		ch = *string_pos++;
+		ch = take();
 		escaped = true;
 	}
-	else if (ch == '[' && *string_pos == '[')
+	else if (ch == '[' && peek() == '[')
 	{
-		++string_pos;
+		take();
 		escaped = true;
 	}
-	else if (ch == ']' && *string_pos == ']')
+	else if (ch == ']' && peek() == ']')
 	{
-		++string_pos;
+		take();
 		escaped = true;
 	}
 	else
@@ -325,224 +672,373 @@ void dom::next_char()
 		escaped = false;
 	}
 
-	if (ch == '\n' || ch == '\r') // '\r' should not appear, but just in case
-	{
-		line_start_pos = string_pos;
-	}
+	return true;
 }
 
-dom::dom(const std::string &dsl_text)
-	: root(std::string(), std::string())
+void dom::parse(node_id root, std::vector<node_id> &stack)
 {
-	std::string cleaned_text = remove_unwanted_tags(dsl_text);
-	cleaned_text = preprocess(cleaned_text);
-	string_pos = cleaned_text.c_str();
-	line_start_pos = string_pos;
+	// Running out of input anywhere simply ends the parsing,
+	// dropping whatever tag or link was being read.
+
+	parse_root = root;
+	stack.clear(); // currently opened tags
+
+	node_id text_node = 0; // current text node
 
-	std::vector<node *> stack; // currently opened tags
+	std::string &name = tag_name;
+	std::string &attrs = tag_attrs;
 
-	node *text_node = nullptr; // current text node
-	try
+	while (next_char())
 	{
-		while (true)
+		if (ch == '[' && !escaped)
 		{
-			next_char();
+			// Beginning of a tag
+			bool is_closing;
+			name.clear();
+			attrs.clear();
 
-			if (ch == '[' && !escaped)
+			do
 			{
-				// Beginning of a tag
-				bool is_closing;
-				std::string name;
-				std::string attrs;
+				if (!next_char())
+					return;
+			} while (std::isspace(ch)); // TODO: Unicode-aware?
 
-				do
-				{
-					next_char();
-				} while (std::isspace(ch)); // TODO: Unicode-aware?
+			if (ch == '/' && !escaped)
+			{
+				// A closing tag
+				is_closing = true;
+				if (!next_char())
+					return;
+			}
+			else
+			{
+				is_closing = false;
+			}
 
-				if (ch == '/' && !escaped)
-				{
-					// A closing tag
-					is_closing = true;
-					next_char();
-				}
-				else
-				{
-					is_closing = false;
-				}
+			// Read tag's name
 
-				// Read tag's name
+			while ((ch != ']' || escaped) && !std::isspace(ch))
+			{
+				name.push_back(ch);
+				if (!next_char())
+					return;
+			}
 
-				while ((ch != ']' || escaped) && !std::isspace(ch))
-				{
-					name.push_back(ch);
-					next_char();
-				}
+			while (std::isspace(ch))
+			{
+				if (!next_char())
+					return;
+			}
 
-				while (std::isspace(ch))
-				{
-					next_char();
-				}
+			// Read attrs
 
-				// Read attrs
+			while (ch != ']' || escaped)
+			{
+				attrs.push_back(ch);
+				if (!next_char())
+					return;
+			}
 
-				while (ch != ']' || escaped)
-				{
-					attrs.push_back(ch);
-					next_char();
-				}
+			// Add the tag, or close it
 
-				// Add the tag, or close it
+			// Close the currently opened text node
+			text_node = 0;
 
-				if (text_node)
-				{
-					// Close the currently opened text node
-					stack.pop_back();
-					text_node = nullptr;
-				}
+			tag_kind tag = classify_tag(name.data(), name.size());
 
-				if (!is_closing)
+			if (!is_closing)
+			{
+				if (tag_is_m(tag))
 				{
-					if (tag_is_m(name))
+					if (!blocks_left)
 					{
-						close_tag("m", stack);
-					}
-					open_tag(name, attrs, stack);
-					if (name == "br")
-					{
-						close_tag("br", stack);
+						truncated = true;
+						return;
 					}
+					--blocks_left;
+					close_tag(tag_kind::m, "m", stack);
 				}
-				else
+				open_tag(tag, name, attrs, stack);
+				if (tag == tag_kind::br)
 				{
-					close_tag(name, stack);
+					close_tag(tag_kind::br, name, stack);
 				}
-				continue;
-			} // if ( ch == '[' )
-			else if (ch == '<' && !escaped)
+			}
+			else
 			{
-				// Special case: the <<name>> link
+				close_tag(tag, name, stack);
+			}
+			continue;
+		} // if ( ch == '[' )
+		else if (ch == '<' && !escaped)
+		{
+			// Special case: the <<name>> link
 
-				next_char();
+			char const *saved_string_pos = string_pos;
+			char const *saved_line_start_pos = line_start_pos;
+			char const *saved_splice_pos = splice_pos;
+			bool saved_line_wrapped = line_wrapped;
 
-				if (ch != '<' || escaped)
-				{
-					// OK, it's not it.
-					--string_pos;
+			if (!next_char())
+				return;
 
-					if (escaped)
-					{
-						--string_pos;
-						escaped = false;
-					}
-					ch = '<';
-				}
-				else
+			if (ch != '<' || escaped)
+			{
+				// OK, it's not it.
+				string_pos = saved_string_pos;
+				line_start_pos = saved_line_start_pos;
+				splice_pos = saved_splice_pos;
+				line_wrapped = saved_line_wrapped;
+				escaped = false;
+				ch = '<';
+			}
+			else
+			{
+				// Get the link's body
+				do
 				{
-					// Get the link's body
-					do
-					{
-						next_char();
-					} while (std::isspace(ch));
+					if (!next_char())
+						return;
+				} while (std::isspace(ch));
 
-					std::string link_to, link_text;
+				std::string &link_text = this->link_text;
+				link_text.clear();
 
-					for (;; next_char())
+				for (;;)
+				{
+					// Is it the end?
+					if (ch == '>' && !escaped)
 					{
-						// Is it the end?
+						if (!next_char())
+							return;
+
 						if (ch == '>' && !escaped)
-						{
-							next_char();
-
-							if (ch == '>' && !escaped)
-								break;
-							else
-							{
-								link_to.push_back('>');
-								link_to.push_back(ch);
-
-								link_text.push_back('>');
-								if (escaped)
-									link_text.push_back('\\');
-								link_text.push_back(ch);
-							}
-						}
+							break;
 						else
 						{
-							link_to.push_back(ch);
+							link_text.push_back('>');
 							if (escaped)
 								link_text.push_back('\\');
 							link_text.push_back(ch);
 						}
 					}
-
-					// Add the corresponing node
-
-					if (text_node)
-					{
-						// Close the currently opened text node
-						stack.pop_back();
-						text_node = nullptr;
-					}
-
-					trim(link_text);
-					process_unsorted_parts(link_text, true);
-					dom node_dom(link_text);
-					node link("ref", std::string());
-					for (auto &n : node_dom.root)
-					{
-						link.push_back(std::move(n));
-					}
-
-					if (stack.empty())
-					{
-						root.push_back(link);
-					}
 					else
 					{
-						stack.back()->push_back(link);
+						if (escaped)
+							link_text.push_back('\\');
+						link_text.push_back(ch);
 					}
-					continue;
+
+					if (!next_char())
+						return;
 				}
-			} // if ( ch == '<' )
 
-			// If we're here, we've got a normal symbol, to be saved as text.
+				// Add the corresponing node
+
+				// Close the currently opened text node
+				text_node = 0;
+
+				trim(link_text);
+				process_unsorted_parts(link_text, true);
 
-			// If there's currently no text node, open one
-			if (!text_node)
+				node link = node();
+				link.is_tag = true;
+				link.tag = tag_kind::ref;
+				link.tag_name = add_chars("ref");
+				link.tag_attrs = span();
+				parse_link(add_node(stack.empty() ? root : stack.back(), link));
+				if (truncated)
+					return;
+				continue;
+			}
+		} // if ( ch == '<' )
+
+		// If we're here, we've got a normal symbol, to be saved as text.
+
+		// If there's currently no text node, open one
+		if (!text_node)
+		{
+			node text = node();
+			text.is_tag = false;
+			text.tag = tag_kind::text;
+			text.text.offset = static_cast<std::uint32_t>(chars.size());
+
+			text_node = add_node(stack.empty() ? root : stack.back(), text);
+		}
+
+		if (escaped && ch == ' ')
+		{
+			// ch = '\xa0'; // Escaped spaces turn into non-breakable ones in Lingvo
+			// The statement commented above is from GoldenDict, which turns spaces into strange UTF-8 'REPLACEMENT CHARACTER'
+			// I don't know why it's needed, so I'm commenting it out for now.
+		}
+
+		// Characters are counted by their first byte; line breaks don't show
+		if (ch != '\n' && ch != '\r' && (static_cast<unsigned char>(ch) & 0xC0) != 0x80)
+		{
+			if (!chars_left)
 			{
-				node text = node(std::string());
+				truncated = true;
+				return;
+			}
+			--chars_left;
+		}
 
-				if (stack.empty())
-				{
-					root.push_back(text);
-					stack.push_back(&root.back());
-				}
-				else
+		chars.push_back(ch);
+		++nodes[text_node].text.size;
+	}
+}
+
+dom::dom()
+{
+	load("", 0);
+}
+
+dom::dom(const char *dsl_text, std::size_t length)
+{
+	load(dsl_text, length);
+}
+
+dom::dom(const std::string &dsl_text)
+	: dom(dsl_text.data(), dsl_text.size())
+{
+}
+
+void dom::load(const char *dsl_text, std::size_t length)
+{
+	blocks_left = chars_left = no_limit;
+	parse_text(dsl_text, length);
+}
+
+namespace
+{
+	/**
+	 * @brief Finds where to cut the article at about want bytes for a preview: after a
+	 * line break, and with every {{comment}} begun before the cut ended before it too,
+	 * so that the cut changes nothing before it.
+	 */
+	std::size_t preview_end(const char *text, std::size_t length, std::size_t want)
+	{
+		const char *last_open = nullptr; // the last "{{" before the cut
+		const char *scanned = text;		 // for "{{", up to there
+		std::size_t end = want;
+		while (end < length)
+		{
+			const char *line_end = static_cast<const char *>(std::memchr(text + end, '\n', length - end));
+			if (!line_end)
+			{
+				return length;
+			}
+			end = line_end - text + 1;
+
+			for (const char *p = scanned; (p = static_cast<const char *>(std::memchr(p, '{', text + end - 1 - p))) != nullptr; ++p)
+			{
+				if (p[1] == '{')
 				{
-					stack.back()->push_back(text);
-					stack.push_back(&stack.back()->back());
+					last_open = p;
 				}
-
-				text_node = stack.back();
 			}
+			scanned = text + end - 1;
 
-			if (escaped && ch == ' ')
+			// It has ended if a '}' follows it
+			if (!last_open || std::memchr(last_open + 2, '}', text + end - (last_open + 2)))
+			{
+				return end;
+			}
+			const char *close = static_cast<const char *>(std::memchr(last_open + 2, '}', length - (last_open + 2 - text)));
+			if (!close)
 			{
-				// ch = '\xa0'; // Escaped spaces turn into non-breakable ones in Lingvo
-				// The statement commented above is from GoldenDict, which turns spaces into strange UTF-8 'REPLACEMENT CHARACTER'
-				// I don't know why it's needed, so I'm commenting it out for now.
+				return length;
 			}
+			end = close - text;
+		}
+		return length;
+	}
+}
+
+const std::size_t dom::no_limit;
+
+bool dom::load_preview(const char *dsl_text, std::size_t length, std::size_t max_blocks, std::size_t max_chars)
+{
+	// Only so much of the article is read as the limits are likely to need, and twice as much
+	// each time they are not reached, so that the time taken depends on the limits only
+	std::size_t want = length;
+	if (max_chars)
+	{
+		want = max_chars * 8 + 1024;
+	}
+	if (max_blocks)
+	{
+		want = std::min(want, max_blocks * 2048 + 1024);
+	}
 
-			text_node->text.push_back(ch);
+	while (true)
+	{
+		const std::size_t end = preview_end(dsl_text, length, want);
+		blocks_left = max_blocks ? max_blocks : no_limit;
+		chars_left = max_chars ? max_chars : no_limit;
+		parse_text(dsl_text, end);
+		if (truncated || end == length)
+		{
+			return truncated;
 		}
+		want = end * 2;
 	}
-	catch (std::exception const &)
+}
+
+void dom::parse_text(const char *dsl_text, std::size_t length)
+{
+	typedef std::chrono::steady_clock clock;
+	clock::time_point start, stripped;
+	std::size_t capacities[4];
+	if (stats_enabled)
+	{
+		counted = converter_stats();
+		capacities[0] = cleaned_text.capacity();
+		capacities[1] = chars.capacity();
+		capacities[2] = nodes.capacity();
+		capacities[3] = open_tags.capacity();
+		start = clock::now();
+	}
+
+	remove_unwanted_tags(dsl_text, length, cleaned_text);
+
+	if (stats_enabled)
 	{
+		stripped = clock::now();
 	}
 
-	if (text_node)
+	// The text ends up in chars with the markup taken out, and a node takes at least two characters
+	chars.clear();
+	nodes.clear();
+	chars.reserve(cleaned_text.size() + 16);
+	nodes.reserve(cleaned_text.size() / 8 + 8);
+	nodes.push_back(node());
+	nodes[0].is_tag = true;
+	nodes[0].tag = tag_kind::unknown;
+
+	string_pos = cleaned_text.data();
+	string_end = string_pos + cleaned_text.size();
+	line_start_pos = string_pos;
+	splice_pos = nullptr;
+	line_wrapped = false;
+	truncated = false;
+	link_depth = 0;
+
+	parse(0, open_tags);
+
+	if (stats_enabled)
 	{
-		stack.pop_back();
+		auto nanoseconds = [](clock::duration d)
+		{ return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()); };
+
+		counted.nanoseconds[converter_stats::strip] = nanoseconds(stripped - start);
+		counted.nanoseconds[converter_stats::parse] = nanoseconds(clock::now() - stripped);
+		counted.calls[converter_stats::strip] = counted.calls[converter_stats::parse] = 1;
+		counted.dsl_bytes = length;
+		counted.nodes = nodes.size() - 1;
+		counted.allocations = (cleaned_text.capacity() != capacities[0]) + (chars.capacity() != capacities[1]) +
+							  (nodes.capacity() != capacities[2]) + (open_tags.capacity() != capacities[3]);
+		record_stats(counted);
 	}
 }
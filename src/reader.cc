@@ -0,0 +1,402 @@
+#include "dsl.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+	void append_code_point(std::string &out, unsigned cp)
+	{
+		if (cp < 0x80)
+		{
+			out.push_back(static_cast<char>(cp));
+		}
+		else if (cp < 0x800)
+		{
+			out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+		}
+		else if (cp < 0x10000)
+		{
+			out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+		}
+		else
+		{
+			out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+		}
+	}
+
+	bool is_space_unit(unsigned u)
+	{
+		return u == ' ' || u == '\t' || u == '\r';
+	}
+}
+
+text_encoding detect_encoding(const char *text, std::size_t size, std::size_t &bom)
+{
+	const unsigned char *data = reinterpret_cast<const unsigned char *>(text);
+
+	bom = 0;
+	if (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF)
+	{
+		bom = 3;
+		return text_encoding::utf8;
+	}
+	if (size >= 2 && data[0] == 0xFF && data[1] == 0xFE)
+	{
+		bom = 2;
+		return text_encoding::utf16le;
+	}
+	if (size >= 2 && data[0] == 0xFE && data[1] == 0xFF)
+	{
+		bom = 2;
+		return text_encoding::utf16be;
+	}
+	if (size >= 2 && data[0] && !data[1])
+	{
+		return text_encoding::utf16le; // ASCII in UTF-16LE without a BOM
+	}
+	if (size >= 2 && !data[0] && data[1])
+	{
+		return text_encoding::utf16be;
+	}
+	return text_encoding::utf8;
+}
+
+void append_utf8(std::string &out, const char *text, std::size_t size, text_encoding encoding)
+{
+	if (encoding == text_encoding::utf8)
+	{
+		out.append(text, size);
+		return;
+	}
+
+	const unsigned char *data = reinterpret_cast<const unsigned char *>(text);
+	auto unit = [data, encoding](std::size_t at) -> unsigned
+	{
+		return encoding == text_encoding::utf16le ? data[at] | (data[at + 1] << 8) : (data[at] << 8) | data[at + 1];
+	};
+
+	size &= ~std::size_t(1);
+	for (std::size_t at = 0; at < size; at += 2)
+	{
+		unsigned u = unit(at);
+		if (u >= 0xD800 && u < 0xDC00 && at + 2 < size && unit(at + 2) >= 0xDC00 && unit(at + 2) < 0xE000)
+		{
+			// Surrogate pair
+			append_code_point(out, 0x10000 + ((u - 0xD800) << 10) + (unit(at + 2) - 0xDC00));
+			at += 2;
+		}
+		else if (u >= 0xD800 && u < 0xE000)
+		{
+			append_code_point(out, 0xFFFD); // Unpaired surrogate
+		}
+		else
+		{
+			append_code_point(out, u);
+		}
+	}
+}
+
+bool is_dictzip_path(const std::string &path)
+{
+	return path.size() >= 3 && path.compare(path.size() - 3, 3, ".dz") == 0;
+}
+
+unsigned dsl_reader::unit(std::size_t at) const
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(begin + at);
+	switch (encoding_)
+	{
+	case text_encoding::utf16le:
+		return p[0] | (p[1] << 8);
+	case text_encoding::utf16be:
+		return (p[0] << 8) | p[1];
+	default:
+		return p[0];
+	}
+}
+
+std::size_t dsl_reader::line_end(std::size_t from) const
+{
+	const std::size_t size = end - begin;
+
+	if (encoding_ == text_encoding::utf8)
+	{
+		const void *found = std::memchr(begin + from, '\n', size - from);
+		return found ? static_cast<const char *>(found) - begin : size;
+	}
+
+	for (std::size_t at = from; at < size; at += 2)
+	{
+		if (unit(at) == '\n')
+		{
+			return at;
+		}
+	}
+	return size;
+}
+
+std::size_t dsl_reader::trim_line_end(std::size_t from, std::size_t to) const
+{
+	while (to > from && is_space_unit(unit(to - unit_size())))
+	{
+		to -= unit_size();
+	}
+	return to;
+}
+
+bool dsl_reader::is_blank(std::size_t from, std::size_t to) const
+{
+	return trim_line_end(from, to) == from;
+}
+
+void dsl_reader::read_header()
+{
+	const std::size_t size = end - begin;
+
+	// Lines such as #NAME "Some Dictionary", until the first article
+	while (pos < size)
+	{
+		std::size_t to = line_end(pos);
+		std::size_t next_line = to < size ? to + unit_size() : size;
+
+		if (is_blank(pos, to))
+		{
+			pos = next_line;
+			continue;
+		}
+		if (unit(pos) != '#')
+		{
+			break;
+		}
+
+		std::string line;
+		append_utf8(line, pos + unit_size(), trim_line_end(pos, to));
+		pos = next_line;
+
+		std::size_t key_end = line.find_first_of(" \t");
+		std::string key = line.substr(0, key_end);
+		std::string value = key_end == std::string::npos ? std::string() : line.substr(key_end);
+		trim(value);
+		if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+		{
+			value = value.substr(1, value.size() - 2);
+		}
+
+		if (key == "NAME")
+		{
+			name_ = value;
+		}
+		else if (key == "INDEX_LANGUAGE")
+		{
+			index_language_ = value;
+		}
+		else if (key == "CONTENTS_LANGUAGE")
+		{
+			contents_language_ = value;
+		}
+	}
+}
+
+dsl_reader::dsl_reader(const std::string &path)
+	: pos(0)
+{
+	std::size_t size;
+	if (is_dictzip_path(path))
+	{
+		dictzip_file dz(path, 1);
+		dz.read(0, dz.size(), inflated);
+		file_size_ = dz.file_size();
+		text = inflated.data();
+		size = inflated.size();
+	}
+	else
+	{
+		file.reset(new mapped_file(path));
+		file_size_ = file->size();
+		text = file->data();
+		size = file->size();
+	}
+
+	std::size_t bom;
+	encoding_ = detect_encoding(text, size, bom);
+
+	begin = text + bom;
+	end = text + size;
+	if (encoding_ != text_encoding::utf8 && (end - begin) % 2)
+	{
+		--end; // A stray byte can't be a UTF-16 code unit
+	}
+
+	read_header();
+}
+
+bool dsl_reader::next(dsl_article &article)
+{
+	const std::size_t size = end - begin;
+	const std::size_t base = begin - text;
+
+	// Headword lines start at the beginning of the line, the body lines that follow them
+	// with a space or a tab. Blank lines are of no consequence.
+
+	headword_ranges.clear();
+	bool in_body = false;
+	std::size_t body_from = pos;
+	std::size_t body_to = pos;
+
+	while (pos < size)
+	{
+		std::size_t to = line_end(pos);
+		std::size_t next_line = to < size ? to + unit_size() : size;
+
+		if (is_blank(pos, to))
+		{
+			pos = next_line;
+			continue;
+		}
+
+		unsigned first = unit(pos);
+		if (first == ' ' || first == '\t')
+		{
+			// Body text without a headword is skipped
+			if (!headword_ranges.empty())
+			{
+				if (!in_body)
+				{
+					in_body = true;
+					body_from = pos;
+				}
+				body_to = to > pos && unit(to - unit_size()) == '\r' ? to - unit_size() : to;
+			}
+			pos = next_line;
+			continue;
+		}
+
+		if (in_body)
+		{
+			break; // The headword of the next article
+		}
+
+		headword_ranges.emplace_back(pos, trim_line_end(pos, to));
+		pos = next_line;
+	}
+
+	if (headword_ranges.empty())
+	{
+		return false;
+	}
+
+	article.headwords.clear();
+	if (encoding_ == text_encoding::utf8)
+	{
+		for (auto const &range : headword_ranges)
+		{
+			article.headwords.push_back(text_ref{begin + range.first, range.second - range.first});
+		}
+	}
+	else
+	{
+		headword_text.clear();
+		for (auto &range : headword_ranges)
+		{
+			std::size_t from = headword_text.size();
+			append_utf8(headword_text, range.first, range.second);
+			range = std::make_pair(from, headword_text.size());
+		}
+		for (auto const &range : headword_ranges)
+		{
+			article.headwords.push_back(text_ref{headword_text.data() + range.first, range.second - range.first});
+		}
+	}
+
+	if (!in_body)
+	{
+		body_from = body_to = pos;
+	}
+	article.offset = base + body_from;
+	article.size = body_to - body_from;
+	article.body = body_at(article.offset, article.size);
+
+	return true;
+}
+
+text_ref dsl_reader::body_at(std::size_t offset, std::size_t size)
+{
+	return body_at(offset, size, body_text);
+}
+
+text_ref dsl_reader::body_at(std::size_t offset, std::size_t size, std::string &buffer) const
+{
+	const std::size_t base = begin - text;
+	const std::size_t limit = end - text;
+	if (offset < base || offset > limit || size > limit - offset ||
+		(offset - base) % unit_size() || size % unit_size())
+	{
+		throw std::out_of_range("no article at this offset");
+	}
+
+	if (encoding_ == text_encoding::utf8)
+	{
+		return text_ref{text + offset, size};
+	}
+
+	buffer.clear();
+	append_utf8(buffer, offset - base, offset - base + size);
+	return text_ref{buffer.data(), buffer.size()};
+}
+
+dsl_file::dsl_file(const std::string &path)
+{
+	std::string head;
+	if (is_dictzip_path(path))
+	{
+		compressed.reset(new dictzip_file(path));
+		text_size = compressed->size();
+		compressed->read(0, std::min<std::size_t>(text_size, 3), head);
+	}
+	else
+	{
+		plain.reset(new mapped_file(path));
+		text_size = plain->size();
+		head.assign(plain->data(), std::min<std::size_t>(text_size, 3));
+	}
+
+	encoding_ = detect_encoding(head.data(), head.size(), bom);
+}
+
+text_ref dsl_file::body_at(std::size_t offset, std::size_t size, std::string &buffer) const
+{
+	const std::size_t unit_size = encoding_ == text_encoding::utf8 ? 1 : 2;
+	if (offset < bom || offset > text_size || size > text_size - offset ||
+		(offset - bom) % unit_size || size % unit_size)
+	{
+		throw std::out_of_range("no article at this offset");
+	}
+
+	if (plain)
+	{
+		if (encoding_ == text_encoding::utf8)
+		{
+			return text_ref{plain->data() + offset, size};
+		}
+		buffer.clear();
+		append_utf8(buffer, plain->data() + offset, size, encoding_);
+		return text_ref{buffer.data(), buffer.size()};
+	}
+
+	compressed->read(offset, size, buffer);
+	if (encoding_ != text_encoding::utf8)
+	{
+		std::string raw;
+		raw.swap(buffer);
+		append_utf8(buffer, raw.data(), raw.size(), encoding_);
+	}
+	return text_ref{buffer.data(), buffer.size()};
+}
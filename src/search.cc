@@ -0,0 +1,741 @@
+#include "dsl.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace
+{
+	enum class char_kind
+	{
+		letter,
+		digit,
+		ideograph, // a word by itself
+		separator,
+		ignored // dropped, without parting words
+	};
+
+	char_kind classify_char(std::uint32_t c)
+	{
+		if (c < 0x80)
+		{
+			if (c >= '0' && c <= '9')
+			{
+				return char_kind::digit;
+			}
+			return (c | 0x20) >= 'a' && (c | 0x20) <= 'z' ? char_kind::letter : char_kind::separator;
+		}
+
+		if (c == 0xAD || c == 0xB7 || (c >= 0x300 && c <= 0x36F) || c == 0x2C8 || c == 0x2CC || (c >= 0x483 && c <= 0x489) ||
+			(c >= 0x1AB0 && c <= 0x1AFF) || (c >= 0x1DC0 && c <= 0x1DFF) || (c >= 0x200B && c <= 0x200D) || c == 0x2027 ||
+			c == 0x2060 || (c >= 0x20D0 && c <= 0x20FF) || (c >= 0xFE00 && c <= 0xFE0F) || c == 0xFEFF)
+		{
+			return char_kind::ignored;
+		}
+
+		if ((c <= 0xBF && c != 0xAA && c != 0xB5 && c != 0xBA) || c == 0xD7 || c == 0xF7 ||
+			c == 0x37E || c == 0x387 || (c >= 0x55A && c <= 0x55F) || c == 0x589 ||
+			c == 0x5BE || c == 0x5C0 || c == 0x5C3 || c == 0x5C6 || c == 0x5F3 || c == 0x5F4 ||
+			c == 0x60C || c == 0x61B || c == 0x61F || (c >= 0x66A && c <= 0x66D) || c == 0x6D4 ||
+			(c >= 0x2000 && c <= 0x2BFF) || (c >= 0x2E00 && c <= 0x2E7F) || (c >= 0x3000 && c <= 0x303F) ||
+			(c >= 0xFE10 && c <= 0xFE1F) || (c >= 0xFE30 && c <= 0xFE6F) || (c >= 0xFF00 && c <= 0xFF0F) ||
+			(c >= 0xFF1A && c <= 0xFF20) || (c >= 0xFF3B && c <= 0xFF40) || (c >= 0xFF5B && c <= 0xFF65) ||
+			(c >= 0xFFF0 && c <= 0xFFFF) || (c >= 0x1F000 && c <= 0x1FAFF))
+		{
+			return char_kind::separator;
+		}
+
+		if ((c >= 0x3040 && c <= 0x30FF) || (c >= 0x3400 && c <= 0x4DBF) || (c >= 0x4E00 && c <= 0x9FFF) ||
+			(c >= 0xF900 && c <= 0xFAFF) || (c >= 0x20000 && c <= 0x3134F))
+		{
+			return char_kind::ideograph;
+		}
+		return char_kind::letter;
+	}
+
+	// Lower case, for the scripts that have it and are common in dictionaries
+	std::uint32_t fold_case(std::uint32_t c)
+	{
+		if (c < 0x80)
+		{
+			return c >= 'A' && c <= 'Z' ? c + 32 : c;
+		}
+		if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+		{
+			return c + 32;
+		}
+		if (c >= 0x100 && c <= 0x17F)
+		{
+			// Pairs start on even code points, but for the run from U+0139 to U+0148 and from U+0179
+			if (c == 0x178)
+			{
+				return 0xFF;
+			}
+			const bool odd_pairs = (c >= 0x139 && c <= 0x148) || c >= 0x179;
+			return (c % 2 == 0) != odd_pairs && c != 0x138 && c != 0x149 && c != 0x17F ? c + 1 : c;
+		}
+		if (c >= 0x370 && c <= 0x3FF)
+		{
+			if (c >= 0x391 && c <= 0x3AB && c != 0x3A2)
+			{
+				return c + 32;
+			}
+			switch (c)
+			{
+			case 0x386:
+				return 0x3AC;
+			case 0x388:
+			case 0x389:
+			case 0x38A:
+				return c + 37;
+			case 0x38C:
+				return 0x3CC;
+			case 0x38E:
+			case 0x38F:
+				return c + 63;
+			case 0x3C2: // final sigma
+				return 0x3C3;
+			default:
+				return c;
+			}
+		}
+		if (c >= 0x400 && c <= 0x40F)
+		{
+			return c + 80;
+		}
+		if (c >= 0x410 && c <= 0x42F)
+		{
+			return c + 32;
+		}
+		if ((c >= 0x460 && c <= 0x481) || (c >= 0x48A && c <= 0x4BF) || (c >= 0x1E00 && c <= 0x1EFF))
+		{
+			return c % 2 == 0 ? c + 1 : c;
+		}
+		if (c >= 0x531 && c <= 0x556)
+		{
+			return c + 48;
+		}
+		if (c >= 0xFF21 && c <= 0xFF3A)
+		{
+			return c + 32;
+		}
+		return c;
+	}
+
+	/**
+	 * @brief Reads a character of UTF-8 text.
+	 * @return false, having skipped a byte, if it is not UTF-8.
+	 */
+	bool decode_utf8(const unsigned char *&p, const unsigned char *end, std::uint32_t &c)
+	{
+		c = *p++;
+		if (c < 0x80)
+		{
+			return true;
+		}
+
+		const int length = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : -1;
+		if (length < 0 || end - p < length)
+		{
+			return false;
+		}
+		c &= 0x3F >> length;
+		for (int i = 0; i < length; i++)
+		{
+			if ((p[i] & 0xC0) != 0x80)
+			{
+				return false;
+			}
+			c = (c << 6) | (p[i] & 0x3F);
+		}
+		p += length;
+		return true;
+	}
+
+	void append_code_point(std::string &out, std::uint32_t c)
+	{
+		if (c < 0x80)
+		{
+			out.push_back(static_cast<char>(c));
+		}
+		else if (c < 0x800)
+		{
+			out.push_back(static_cast<char>(0xC0 | (c >> 6)));
+			out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+		}
+		else if (c < 0x10000)
+		{
+			out.push_back(static_cast<char>(0xE0 | (c >> 12)));
+			out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+		}
+		else
+		{
+			out.push_back(static_cast<char>(0xF0 | (c >> 18)));
+			out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+		}
+	}
+
+	void append_varint(std::string &out, std::uint32_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back(static_cast<char>(0x80 | (value & 0x7F)));
+			value >>= 7;
+		}
+		out.push_back(static_cast<char>(value));
+	}
+}
+
+word_splitter::word_splitter(std::function<void(const std::string &)> emit)
+	: emit(std::move(emit)), joiner(0), ends_in_digit(false) {}
+
+void word_splitter::end_word()
+{
+	if (!word.empty())
+	{
+		emit(word);
+		word.clear();
+	}
+	joiner = 0;
+}
+
+void word_splitter::add_char(std::uint32_t c)
+{
+	switch (classify_char(c))
+	{
+	case char_kind::letter:
+	case char_kind::digit:
+	{
+		const bool digit = c < 0x80 && c >= '0' && c <= '9';
+		if (joiner)
+		{
+			// An apostrophe joins letters, a point or comma digits
+			if ((joiner == '\'') == !digit && ends_in_digit == digit)
+			{
+				word.push_back(joiner);
+				joiner = 0;
+			}
+			else
+			{
+				end_word();
+			}
+		}
+		append_code_point(word, fold_case(c));
+		ends_in_digit = digit;
+		break;
+	}
+	case char_kind::ideograph:
+		end_word();
+		append_code_point(word, c);
+		end_word();
+		break;
+	case char_kind::ignored:
+		break;
+	default:
+		if (!word.empty() && !joiner)
+		{
+			if ((c == '\'' || c == 0x2019) && !ends_in_digit)
+			{
+				joiner = '\'';
+				break;
+			}
+			if ((c == '.' || c == ',') && ends_in_digit)
+			{
+				joiner = static_cast<char>(c);
+				break;
+			}
+		}
+		end_word();
+		break;
+	}
+}
+
+void word_splitter::add_text(const char *text, std::size_t size)
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(text);
+	const unsigned char *end = p + size;
+	while (p != end)
+	{
+		std::uint32_t c;
+		if (decode_utf8(p, end, c))
+		{
+			add_char(c);
+		}
+		else
+		{
+			end_word(); // Anything that is not UTF-8 parts words
+		}
+	}
+}
+
+std::string fold_case(const std::string &text)
+{
+	std::string folded;
+	folded.reserve(text.size());
+
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(text.data());
+	const unsigned char *end = p + text.size();
+	while (p != end)
+	{
+		const unsigned char *from = p;
+		std::uint32_t c;
+		if (decode_utf8(p, end, c))
+		{
+			append_code_point(folded, fold_case(c));
+		}
+		else
+		{
+			folded.push_back(static_cast<char>(*from));
+		}
+	}
+	return folded;
+}
+
+const char search_index::magic[8] = {'D', 'S', 'L', 'F', 'T', 'S', '1', '\0'};
+
+// Goes through the article numbers of a word, in order
+class search_index::postings_reader
+{
+private:
+	const unsigned char *begin;
+	const unsigned char *pos;
+	const unsigned char *end;
+	std::size_t count;
+	std::size_t read;
+	const skip *skips;
+	std::size_t skip_count;
+
+public:
+	std::uint32_t id; // the last one read
+
+	postings_reader(const search_index &index, const term_entry &t)
+		: begin(index.postings + t.postings_offset), pos(begin), end(index.postings + index.postings_end(t)),
+		  count(t.count), read(0), skips(index.skips_of(t)), skip_count((t.count - 1) / skip_interval), id(0) {}
+
+	// false once there are no more
+	bool next()
+	{
+		if (read == count)
+		{
+			return false;
+		}
+
+		std::uint32_t delta = 0;
+		for (int shift = 0;; shift += 7)
+		{
+			if (pos == end || shift > 28)
+			{
+				throw std::runtime_error("corrupt full-text index");
+			}
+			const unsigned char byte = *pos++;
+			delta |= static_cast<std::uint32_t>(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+			{
+				break;
+			}
+		}
+		id += delta;
+		++read;
+		return true;
+	}
+
+	// Reads up to the first article not before target; false if there is none
+	bool seek(std::uint32_t target)
+	{
+		if (read && id >= target)
+		{
+			return true;
+		}
+
+		// Jumps to the last block ahead that starts before target, if any
+		const skip *ahead = skips + std::min<std::size_t>(read / skip_interval, skip_count);
+		if (ahead != skips + skip_count && ahead->id < target)
+		{
+			const skip *after = std::lower_bound(ahead + 1, skips + skip_count, target, [](const skip &s, std::uint32_t t)
+												 { return s.id < t; });
+			const skip &jump = after[-1];
+			if (jump.offset > static_cast<std::size_t>(end - begin))
+			{
+				throw std::runtime_error("corrupt full-text index");
+			}
+			pos = begin + jump.offset;
+			id = jump.id;
+			read = (after - skips) * skip_interval;
+		}
+
+		while (!read || id < target)
+		{
+			if (!next())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+search_index::search_index(const std::string &path, std::size_t dsl_size)
+	: file(path)
+{
+	const header *h = reinterpret_cast<const header *>(file.data());
+	if (file.size() < sizeof(header) || std::memcmp(h->magic, magic, sizeof(magic)) != 0)
+	{
+		throw std::runtime_error(path + " is not a full-text index");
+	}
+	if (h->dsl_size != dsl_size)
+	{
+		throw std::runtime_error(path + " is out of date");
+	}
+
+	std::size_t left = file.size() - sizeof(header);
+	if (h->article_count > left / sizeof(article_entry))
+	{
+		throw std::runtime_error(path + " is truncated");
+	}
+	left -= h->article_count * sizeof(article_entry);
+	if (h->term_count > left / sizeof(term_entry))
+	{
+		throw std::runtime_error(path + " is truncated");
+	}
+	left -= h->term_count * sizeof(term_entry);
+	if (h->skip_count > left / sizeof(skip))
+	{
+		throw std::runtime_error(path + " is truncated");
+	}
+	left -= h->skip_count * sizeof(skip);
+	if (h->postings_size > left || h->strings_size > left - h->postings_size)
+	{
+		throw std::runtime_error(path + " is truncated");
+	}
+
+	article_count = h->article_count;
+	articles = reinterpret_cast<const article_entry *>(file.data() + sizeof(header));
+	term_count = h->term_count;
+	terms = reinterpret_cast<const term_entry *>(articles + article_count);
+	skip_count = h->skip_count;
+	skips = reinterpret_cast<const skip *>(terms + term_count);
+	postings_size = h->postings_size;
+	postings = reinterpret_cast<const unsigned char *>(skips + skip_count);
+	strings_size = h->strings_size;
+	strings = reinterpret_cast<const char *>(postings + postings_size);
+}
+
+search_index::location search_index::article(std::size_t id) const
+{
+	if (id >= article_count)
+	{
+		throw std::out_of_range("no such article");
+	}
+	return articles[id].article;
+}
+
+std::vector<std::string> search_index::headwords(std::size_t id) const
+{
+	if (id >= article_count)
+	{
+		throw std::out_of_range("no such article");
+	}
+	const article_entry &a = articles[id];
+	if (a.headwords_offset > strings_size || a.headwords_size > strings_size - a.headwords_offset)
+	{
+		throw std::runtime_error("corrupt full-text index");
+	}
+
+	std::vector<std::string> found;
+	const char *p = strings + a.headwords_offset;
+	const char *end = p + a.headwords_size;
+	while (p != end)
+	{
+		const char *line_end = static_cast<const char *>(std::memchr(p, '\n', end - p));
+		if (!line_end)
+		{
+			line_end = end;
+		}
+		found.emplace_back(p, line_end);
+		p = line_end == end ? end : line_end + 1;
+	}
+	return found;
+}
+
+const search_index::term_entry *search_index::find_term(const std::string &word) const
+{
+	auto compare = [this](const term_entry &t, const std::string &key)
+	{
+		// Checked here rather than up front, so that opening doesn't read the whole index
+		if (t.key_offset > strings_size || t.key_size > strings_size - t.key_offset)
+		{
+			throw std::runtime_error("corrupt full-text index");
+		}
+		const std::size_t size = std::min<std::size_t>(t.key_size, key.size());
+		int result = std::memcmp(strings + t.key_offset, key.data(), size);
+		return result != 0 ? result : t.key_size < key.size() ? -1 : t.key_size > key.size() ? 1 : 0;
+	};
+
+	const term_entry *t = std::lower_bound(terms, terms + term_count, word, [&compare](const term_entry &t, const std::string &key)
+										   { return compare(t, key) < 0; });
+	return t != terms + term_count && compare(*t, word) == 0 ? t : nullptr;
+}
+
+std::size_t search_index::postings_end(const term_entry &t) const
+{
+	const std::size_t end = &t + 1 == terms + term_count ? postings_size : (&t + 1)->postings_offset;
+	if (t.postings_offset > end || end > postings_size)
+	{
+		throw std::runtime_error("corrupt full-text index");
+	}
+	return end;
+}
+
+const search_index::skip *search_index::skips_of(const term_entry &t) const
+{
+	const std::size_t count = (t.count - 1) / skip_interval;
+	if (!t.count || t.first_skip > skip_count || count > skip_count - t.first_skip)
+	{
+		throw std::runtime_error("corrupt full-text index");
+	}
+	return skips + t.first_skip;
+}
+
+std::vector<std::uint32_t> search_index::find(const std::string &query) const
+{
+	std::vector<std::string> words;
+	word_splitter splitter([&words](const std::string &word)
+						   { words.push_back(word); });
+	splitter.add_text(query.data(), query.size());
+	splitter.end_word();
+
+	std::vector<const term_entry *> found;
+	for (auto const &word : words)
+	{
+		const term_entry *t = find_term(word);
+		if (!t)
+		{
+			return std::vector<std::uint32_t>();
+		}
+		found.push_back(t);
+	}
+	if (found.empty())
+	{
+		return std::vector<std::uint32_t>();
+	}
+
+	// The rarest word first, so that the others are only checked against its few articles
+	std::sort(found.begin(), found.end());
+	found.erase(std::unique(found.begin(), found.end()), found.end());
+	std::sort(found.begin(), found.end(), [](const term_entry *a, const term_entry *b)
+			  { return a->count < b->count; });
+
+	std::vector<std::uint32_t> ids;
+	ids.reserve(found[0]->count);
+	postings_reader first(*this, *found[0]);
+	while (first.next())
+	{
+		ids.push_back(first.id);
+	}
+
+	for (std::size_t i = 1; i < found.size() && !ids.empty(); i++)
+	{
+		postings_reader other(*this, *found[i]);
+		std::size_t kept = 0;
+		for (std::uint32_t id : ids)
+		{
+			if (!other.seek(id))
+			{
+				break;
+			}
+			if (other.id == id)
+			{
+				ids[kept++] = id;
+			}
+		}
+		ids.resize(kept);
+	}
+	return ids;
+}
+
+std::size_t search_index::build(const std::string &dsl_path, const std::string &index_path, unsigned threads)
+{
+	dsl_reader reader(dsl_path);
+
+	// The headwords go first in the strings, the words after them
+	std::vector<article_entry> entries;
+	std::string strings;
+	dsl_article a;
+	while (reader.next(a))
+	{
+		article_entry e;
+		e.article.offset = a.offset;
+		e.article.size = a.size;
+		e.headwords_offset = strings.size();
+		for (auto const &headword : a.headwords)
+		{
+			strings.append(headword.data, headword.size).push_back('\n');
+		}
+		e.headwords_size = strings.size() - e.headwords_offset;
+		entries.push_back(e);
+	}
+	if (entries.size() > UINT32_MAX)
+	{
+		throw std::runtime_error("too many articles in " + dsl_path);
+	}
+
+	// Each batch of articles gets its words on its own; as the batches follow one
+	// another, the numbers of a word stay sorted when the batches are put together.
+	typedef std::unordered_map<std::string, std::vector<std::uint32_t>> postings_map;
+	const std::size_t batch_size = 256;
+	std::vector<postings_map> batches((entries.size() + batch_size - 1) / batch_size);
+
+	parallel_for(batches.size(), threads, [&](std::size_t b)
+				 {
+		postings_map &words = batches[b];
+		std::uint32_t id = 0;
+		word_splitter splitter([&words, &id](const std::string &word)
+							   {
+			std::vector<std::uint32_t> &ids = words[word];
+			if (ids.empty() || ids.back() != id)
+			{
+				ids.push_back(id);
+			} });
+
+		dom tree;
+		std::string buffer;
+		auto open = [&tree, &splitter](const node &n)
+		{
+			if (!n.is_tag)
+			{
+				splitter.add_text(tree.data(n.text), n.text.size);
+				return true;
+			}
+			switch (n.tag)
+			{
+			case tag_kind::s:
+			case tag_kind::video:
+			case tag_kind::url:
+				return false; // file names and addresses
+			default:
+				if (n.tag == tag_kind::br || (n.tag >= tag_kind::m && n.tag <= tag_kind::m9))
+				{
+					splitter.end_word();
+				}
+				return true;
+			}
+		};
+		auto close = [&splitter](const node &n)
+		{
+			if (n.is_tag && n.tag >= tag_kind::m && n.tag <= tag_kind::m9)
+			{
+				splitter.end_word();
+			}
+		};
+
+		const std::size_t end = std::min(entries.size(), (b + 1) * batch_size);
+		for (std::size_t i = b * batch_size; i < end; i++)
+		{
+			id = static_cast<std::uint32_t>(i);
+			const article_entry &e = entries[i];
+			splitter.add_text(strings.data() + e.headwords_offset, e.headwords_size);
+			splitter.end_word();
+
+			try
+			{
+				text_ref body = reader.body_at(e.article.offset, e.article.size, buffer);
+				tree.load(body.data, body.size);
+			}
+			catch (const std::bad_alloc &)
+			{
+				throw;
+			}
+			catch (const std::exception &)
+			{
+				continue; // Malformed; found by its headwords only
+			}
+			tree.walk(tree.root(), open, close);
+			splitter.end_word();
+		} });
+
+	postings_map all;
+	for (postings_map &batch : batches)
+	{
+		for (auto &word : batch)
+		{
+			std::vector<std::uint32_t> &ids = all[word.first];
+			if (ids.empty())
+			{
+				ids.swap(word.second);
+			}
+			else
+			{
+				ids.insert(ids.end(), word.second.begin(), word.second.end());
+			}
+		}
+		postings_map().swap(batch);
+	}
+
+	std::vector<const postings_map::value_type *> sorted;
+	sorted.reserve(all.size());
+	for (auto const &word : all)
+	{
+		sorted.push_back(&word);
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const postings_map::value_type *a, const postings_map::value_type *b)
+			  { return a->first < b->first; });
+
+	std::vector<term_entry> terms;
+	terms.reserve(sorted.size());
+	std::vector<skip> skips;
+	std::string postings;
+	for (auto const *word : sorted)
+	{
+		term_entry t;
+		t.key_offset = strings.size();
+		t.key_size = static_cast<std::uint32_t>(word->first.size());
+		t.count = static_cast<std::uint32_t>(word->second.size());
+		t.postings_offset = postings.size();
+		t.first_skip = skips.size();
+		terms.push_back(t);
+		strings.append(word->first);
+
+		std::uint32_t previous = 0;
+		for (std::size_t i = 0; i < word->second.size(); i++)
+		{
+			if (i && i % skip_interval == 0)
+			{
+				skips.push_back(skip{previous, static_cast<std::uint32_t>(postings.size() - t.postings_offset)});
+			}
+			append_varint(postings, word->second[i] - previous);
+			previous = word->second[i];
+		}
+	}
+
+	std::ofstream out(index_path, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		throw std::runtime_error("cannot write " + index_path);
+	}
+
+	header h;
+	std::memcpy(h.magic, magic, sizeof(magic));
+	h.dsl_size = reader.file_size();
+	h.article_count = entries.size();
+	h.term_count = terms.size();
+	h.postings_size = postings.size();
+	h.skip_count = skips.size();
+	h.strings_size = strings.size();
+	out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+	out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(article_entry));
+	out.write(reinterpret_cast<const char *>(terms.data()), terms.size() * sizeof(term_entry));
+	out.write(reinterpret_cast<const char *>(skips.data()), skips.size() * sizeof(skip));
+	out.write(postings.data(), postings.size());
+	out.write(strings.data(), strings.size());
+
+	if (!out.flush())
+	{
+		throw std::runtime_error("cannot write " + index_path);
+	}
+
+	return entries.size();
+}
@@ -0,0 +1,305 @@
+#include "dsl.h"
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The memory starts zeroed, and all zeros is an empty cache of no layout yet
+struct shared_html_cache::header
+{
+	std::atomic<std::uint64_t> layout; // magic and slot size
+	std::atomic<std::uint64_t> size;
+	char padding[48];
+};
+
+struct shared_html_cache::slot
+{
+	std::atomic<std::uint32_t> sequence; // 0 if never written, odd while being written
+	std::atomic<std::uint32_t> html_size;
+	std::atomic<std::uint32_t> resources_size;
+	std::atomic<std::uint32_t> resources_count;
+	std::atomic<std::uint64_t> hash[2];
+	// Then the HTML, then the resource names, each as a 32-bit size and the bytes
+};
+
+namespace
+{
+	const std::uint64_t magic = 0x44534C32ull << 32; // "DSL2"
+
+	std::string segment_name(const std::string &name)
+	{
+#ifdef _WIN32
+		return name;
+#else
+		return name.size() && name[0] == '/' ? name : '/' + name;
+#endif
+	}
+}
+
+shared_html_cache::shared_html_cache(const std::string &name, std::size_t size, std::size_t slot_size)
+	: memory(nullptr)
+	, size_(size)
+	, slot_size(slot_size)
+	, slot_count(0)
+	, hits(0)
+	, misses(0)
+	, stores(0)
+{
+	if (slot_size < 2 * sizeof(slot) || slot_size % alignof(slot) || size < sizeof(header) + slot_size)
+	{
+		throw std::runtime_error("shared cache too small");
+	}
+	slot_count = (size - sizeof(header)) / slot_size;
+
+	const std::string segment = segment_name(name);
+#ifdef _WIN32
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+										static_cast<DWORD>(static_cast<std::uint64_t>(size) >> 32), static_cast<DWORD>(size), segment.c_str());
+	if (!mapping)
+	{
+		throw std::runtime_error("cannot create shared memory " + name);
+	}
+	memory = static_cast<char *>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+	CloseHandle(mapping); // The view keeps the mapping alive
+	if (!memory)
+	{
+		throw std::runtime_error("cannot map shared memory " + name);
+	}
+#else
+	// Only the process that creates the segment sets its size; zero-filled, like a fresh header wants
+	int fd = shm_open(segment.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	const bool created = fd >= 0;
+	if (!created && errno == EEXIST)
+	{
+		fd = shm_open(segment.c_str(), O_RDWR, 0600);
+	}
+	if (fd < 0)
+	{
+		throw std::runtime_error("cannot create shared memory " + name);
+	}
+	if (created && ftruncate(fd, size) != 0)
+	{
+		close(fd);
+		shm_unlink(segment.c_str());
+		throw std::runtime_error("cannot size shared memory " + name);
+	}
+
+	// The creator may not have sized it yet. Mapping more than the segment holds
+	// would raise SIGBUS on the missing pages, so the sizes must match first.
+	struct stat st;
+	for (int wait = 0; fstat(fd, &st) == 0 && st.st_size == 0 && wait < 1000; wait++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("cannot open shared memory " + name);
+	}
+	if (st.st_size == 0)
+	{
+		close(fd);
+		throw std::runtime_error("shared memory " + name + " was never sized by the process creating it");
+	}
+	if (static_cast<std::size_t>(st.st_size) != size)
+	{
+		close(fd);
+		throw std::runtime_error("shared memory " + name + " exists with another size");
+	}
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		throw std::runtime_error("cannot map shared memory " + name);
+	}
+	memory = static_cast<char *>(p);
+#endif
+
+	// Agree on the layout with the processes attached before
+	header *head = reinterpret_cast<header *>(memory);
+	if (!head->layout.is_lock_free())
+	{
+		unmap();
+		throw std::runtime_error("no lock-free 64-bit atomics for shared memory");
+	}
+
+	std::uint64_t expected_size = 0;
+	std::uint64_t expected_layout = 0;
+	const std::uint64_t layout = magic | slot_size;
+	if ((!head->size.compare_exchange_strong(expected_size, size) && expected_size != size) ||
+		(!head->layout.compare_exchange_strong(expected_layout, layout) && expected_layout != layout))
+	{
+		unmap();
+		throw std::runtime_error("shared memory " + name + " exists with another layout");
+	}
+}
+
+void shared_html_cache::unmap()
+{
+	if (!memory)
+	{
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(memory);
+#else
+	munmap(memory, size_);
+#endif
+	memory = nullptr;
+}
+
+shared_html_cache::~shared_html_cache()
+{
+	unmap();
+}
+
+void shared_html_cache::remove(const std::string &name)
+{
+#ifndef _WIN32
+	// Windows drops the segment by itself once no process has it mapped
+	if (shm_unlink(segment_name(name).c_str()) != 0 && errno != ENOENT)
+	{
+		throw std::runtime_error("cannot remove shared memory " + name);
+	}
+#endif
+}
+
+void shared_html_cache::key_hash(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup, std::uint64_t (&hash)[2])
+{
+	const std::uint64_t seeds[2] = {0, 0x243F6A8885A308D3ull};
+	for (int i = 0; i < 2; i++)
+	{
+		std::uint64_t h = hash_bytes(seeds[i], dsl, size);
+		h = hash_bytes(h, base_url_static_files.data(), base_url_static_files.size());
+		hash[i] = hash_bytes(h, base_url_lookup.data(), base_url_lookup.size());
+	}
+}
+
+shared_html_cache::slot &shared_html_cache::slot_at(std::uint64_t hash) const
+{
+	return *reinterpret_cast<slot *>(memory + sizeof(header) + hash % slot_count * slot_size);
+}
+
+shared_html_cache::counters shared_html_cache::get_counters() const
+{
+	counters c = {hits, misses, stores, slot_count, slot_size};
+	return c;
+}
+
+bool shared_html_cache::find(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup,
+							 std::string &html, std::vector<std::string> &resources_name)
+{
+	std::uint64_t hash[2];
+	key_hash(dsl, size, base_url_static_files, base_url_lookup, hash);
+	slot &s = slot_at(hash[0]);
+	const char *data = reinterpret_cast<const char *>(&s + 1);
+	const std::size_t capacity = slot_size - sizeof(slot);
+
+	const std::uint32_t sequence = s.sequence.load(std::memory_order_acquire);
+	const std::size_t html_size = s.html_size.load(std::memory_order_relaxed);
+	const std::size_t resources_size = s.resources_size.load(std::memory_order_relaxed);
+	const std::size_t resources_count = s.resources_count.load(std::memory_order_relaxed);
+	if (sequence == 0 || sequence % 2 ||
+		s.hash[0].load(std::memory_order_relaxed) != hash[0] || s.hash[1].load(std::memory_order_relaxed) != hash[1] ||
+		html_size > capacity || resources_size > capacity - html_size)
+	{
+		misses++;
+		return false;
+	}
+
+	// Copied first and checked after: a writer may have been at it meanwhile
+	html.assign(data, html_size);
+	std::string resources(data + html_size, resources_size);
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (s.sequence.load(std::memory_order_relaxed) != sequence)
+	{
+		misses++;
+		return false;
+	}
+
+	resources_name.clear();
+	resources_name.reserve(resources_count);
+	for (std::size_t from = 0; resources_name.size() < resources_count;)
+	{
+		std::uint32_t name_size;
+		if (resources.size() - from < sizeof(name_size))
+		{
+			misses++;
+			return false;
+		}
+		std::memcpy(&name_size, resources.data() + from, sizeof(name_size));
+		from += sizeof(name_size);
+		if (resources.size() - from < name_size)
+		{
+			misses++;
+			return false;
+		}
+		resources_name.emplace_back(resources, from, name_size);
+		from += name_size;
+	}
+
+	hits++;
+	return true;
+}
+
+void shared_html_cache::insert(const char *dsl, std::size_t size, const std::string &base_url_static_files, const std::string &base_url_lookup,
+							   const std::string &html, const std::vector<std::string> &resources_name)
+{
+	std::size_t resources_size = 0;
+	for (auto const &name : resources_name)
+	{
+		resources_size += sizeof(std::uint32_t) + name.size();
+	}
+	if (html.size() + resources_size > slot_size - sizeof(slot))
+	{
+		return;
+	}
+
+	std::uint64_t hash[2];
+	key_hash(dsl, size, base_url_static_files, base_url_lookup, hash);
+	slot &s = slot_at(hash[0]);
+	char *data = reinterpret_cast<char *>(&s + 1);
+
+	// Another process writing this slot wins; this is only a cache.
+	// (A process that dies while writing leaves its slot unused for good.)
+	std::uint32_t sequence = s.sequence.load(std::memory_order_relaxed);
+	if (sequence % 2 || !s.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+	{
+		return;
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+
+	s.hash[0].store(hash[0], std::memory_order_relaxed);
+	s.hash[1].store(hash[1], std::memory_order_relaxed);
+	s.html_size.store(html.size(), std::memory_order_relaxed);
+	s.resources_size.store(resources_size, std::memory_order_relaxed);
+	s.resources_count.store(resources_name.size(), std::memory_order_relaxed);
+	std::memcpy(data, html.data(), html.size());
+	data += html.size();
+	for (auto const &name : resources_name)
+	{
+		const std::uint32_t name_size = name.size();
+		std::memcpy(data, &name_size, sizeof(name_size));
+		data += sizeof(name_size);
+		std::memcpy(data, name.data(), name.size());
+		data += name.size();
+	}
+
+	s.sequence.store(sequence + 2, std::memory_order_release);
+	stores++;
+}
@@ -0,0 +1,100 @@
+#include "dsl.h"
+
+#include <algorithm>
+
+void converter_stats::add(const converter_stats &other)
+{
+	for (int s = 0; s < stage_count; s++)
+	{
+		nanoseconds[s] += other.nanoseconds[s];
+		calls[s] += other.calls[s];
+	}
+	dsl_bytes += other.dsl_bytes;
+	html_bytes += other.html_bytes;
+	nodes += other.nodes;
+	tags_opened += other.tags_opened;
+	tags_closed += other.tags_closed;
+	tags_reopened += other.tags_reopened;
+	allocations += other.allocations;
+	max_depth = std::max(max_depth, other.max_depth);
+}
+
+namespace
+{
+	struct thread_counters;
+
+	// Every thread that has counted something, and what the threads gone had counted
+	struct registry
+	{
+		std::mutex mutex;
+		std::vector<thread_counters *> threads;
+		converter_stats retired;
+
+		registry() : retired() {}
+	};
+
+	registry &all_threads()
+	{
+		static registry r;
+		return r;
+	}
+
+	struct thread_counters
+	{
+		std::mutex mutex; // only ever waited for while collecting or resetting
+		converter_stats stats;
+
+		thread_counters() : stats()
+		{
+			registry &r = all_threads();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			r.threads.push_back(this);
+		}
+
+		~thread_counters()
+		{
+			registry &r = all_threads();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			r.retired.add(stats);
+			r.threads.erase(std::find(r.threads.begin(), r.threads.end(), this));
+		}
+	};
+
+	thread_counters &this_thread()
+	{
+		static thread_local thread_counters counters;
+		return counters;
+	}
+}
+
+void record_stats(const converter_stats &s)
+{
+	thread_counters &counters = this_thread();
+	std::lock_guard<std::mutex> lock(counters.mutex);
+	counters.stats.add(s);
+}
+
+converter_stats collect_stats()
+{
+	registry &r = all_threads();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	converter_stats total = r.retired;
+	for (thread_counters *t : r.threads)
+	{
+		std::lock_guard<std::mutex> thread_lock(t->mutex);
+		total.add(t->stats);
+	}
+	return total;
+}
+
+void reset_stats()
+{
+	registry &r = all_threads();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	r.retired = converter_stats();
+	for (thread_counters *t : r.threads)
+	{
+		std::lock_guard<std::mutex> thread_lock(t->mutex);
+		t->stats = converter_stats();
+	}
+}
@@ -1,7 +1,38 @@
 #include "dsl.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DSL_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define DSL_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define DSL_TARGET_AVX2
+#else
+#define DSL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#endif
 
 void ltrim(std::string &s)
 {
@@ -23,32 +54,372 @@ void trim(std::string &s)
 	ltrim(s);
 }
 
-std::string html_escape(const std::string &s)
+namespace
 {
-	std::string result;
-	result.reserve(s.size());
-	for (char c : s)
+	// Length of the run at s that can be copied as is, i.e. up to the first character
+	// that html_escape_append must replace (or drop)
+
+	std::size_t plain_run_scalar(const char *s, std::size_t size, bool drop_line_breaks)
+	{
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			switch (s[i])
+			{
+			case '&':
+			case '\"':
+			case '\'':
+			case '<':
+			case '>':
+				return i;
+			case '\r':
+			case '\n':
+				if (drop_line_breaks)
+					return i;
+				break;
+			}
+		}
+		return size;
+	}
+
+	inline unsigned first_set_bit(unsigned mask)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return index;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+#ifdef DSL_SSE2
+	std::size_t plain_run_sse2(const char *s, std::size_t size, bool drop_line_breaks)
+	{
+		const __m128i amp = _mm_set1_epi8('&');
+		const __m128i quot = _mm_set1_epi8('\"');
+		const __m128i apos = _mm_set1_epi8('\'');
+		const __m128i lt = _mm_set1_epi8('<');
+		const __m128i gt = _mm_set1_epi8('>');
+		const __m128i cr = _mm_set1_epi8(drop_line_breaks ? '\r' : '&');
+		const __m128i lf = _mm_set1_epi8(drop_line_breaks ? '\n' : '&');
+
+		std::size_t i = 0;
+		for (; i + 16 <= size; i += 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+			__m128i hits = _mm_or_si128(
+				_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)),
+							 _mm_or_si128(_mm_cmpeq_epi8(v, apos), _mm_cmpeq_epi8(v, lt))),
+				_mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf))));
+			unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+			if (mask)
+			{
+				return i + first_set_bit(mask);
+			}
+		}
+		return i + plain_run_scalar(s + i, size - i, drop_line_breaks);
+	}
+#endif
+
+#ifdef DSL_AVX2
+	DSL_TARGET_AVX2 std::size_t plain_run_avx2(const char *s, std::size_t size, bool drop_line_breaks)
 	{
-		switch (c)
+		const __m256i amp = _mm256_set1_epi8('&');
+		const __m256i quot = _mm256_set1_epi8('\"');
+		const __m256i apos = _mm256_set1_epi8('\'');
+		const __m256i lt = _mm256_set1_epi8('<');
+		const __m256i gt = _mm256_set1_epi8('>');
+		const __m256i cr = _mm256_set1_epi8(drop_line_breaks ? '\r' : '&');
+		const __m256i lf = _mm256_set1_epi8(drop_line_breaks ? '\n' : '&');
+
+		std::size_t i = 0;
+		for (; i + 32 <= size; i += 32)
+		{
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+			__m256i hits = _mm256_or_si256(
+				_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, quot)),
+								_mm256_or_si256(_mm256_cmpeq_epi8(v, apos), _mm256_cmpeq_epi8(v, lt))),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf))));
+			unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+			if (mask)
+			{
+				return i + first_set_bit(mask);
+			}
+		}
+		return i + plain_run_sse2(s + i, size - i, drop_line_breaks);
+	}
+
+	bool cpu_has_avx2()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		bool osxsave_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28));
+		if (!osxsave_avx || (_xgetbv(0) & 6) != 6) // XMM and YMM state enabled by the OS
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#endif
+
+	typedef std::size_t (*plain_run_finder)(const char *s, std::size_t size, bool drop_line_breaks);
+
+	plain_run_finder select_plain_run()
+	{
+#ifdef DSL_AVX2
+		if (cpu_has_avx2())
+			return plain_run_avx2;
+#endif
+#ifdef DSL_SSE2
+		return plain_run_sse2;
+#else
+		return plain_run_scalar;
+#endif
+	}
+
+	const plain_run_finder plain_run = select_plain_run();
+}
+
+void html_escape_append(std::string &out, const char *s, std::size_t size, bool drop_line_breaks)
+{
+	const char *const end = s + size;
+	while (s != end)
+	{
+		std::size_t run = plain_run(s, end - s, drop_line_breaks);
+		out.append(s, run);
+		s += run;
+		if (s == end)
+		{
+			break;
+		}
+
+		switch (*s)
 		{
 		case '&':
-			result += "&amp;";
+			out += "&amp;";
 			break;
 		case '\"':
-			result += "&quot;";
+			out += "&quot;";
 			break;
 		case '\'':
-			result += "&apos;";
+			out += "&apos;";
 			break;
 		case '<':
-			result += "&lt;";
+			out += "&lt;";
 			break;
 		case '>':
-			result += "&gt;";
+			out += "&gt;";
 			break;
-		default:
-			result += c;
+		case '\r':
+		case '\n':
+			break; // Only found when dropping line breaks
 		}
+		++s;
 	}
+}
+
+std::string html_escape(const std::string &s)
+{
+	std::string result;
+	result.reserve(s.size());
+	html_escape_append(result, s.data(), s.size(), false);
 	return result;
 }
+
+unsigned default_thread_count()
+{
+	unsigned threads = std::thread::hardware_concurrency();
+	return threads ? threads : 1;
+}
+
+void parallel_for(std::size_t count, unsigned threads, const std::function<void(std::size_t)> &body)
+{
+	// More threads than cores would only take turns, and the system may not let us start them
+	if (!threads || threads > default_thread_count())
+	{
+		threads = default_thread_count();
+	}
+	threads = static_cast<unsigned>(std::min<std::size_t>(threads, count));
+
+	if (threads <= 1)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			body(i);
+		}
+		return;
+	}
+
+	// Each worker takes the next index as soon as it is done with the previous one,
+	// so one long item does not hold up the items queued behind it.
+	std::atomic<std::size_t> next(0);
+	std::exception_ptr error;
+	std::atomic<bool> failed(false);
+
+	auto work = [&]()
+	{
+		try
+		{
+			while (!failed)
+			{
+				std::size_t i = next++;
+				if (i >= count)
+				{
+					break;
+				}
+				body(i);
+			}
+		}
+		catch (...)
+		{
+			if (!failed.exchange(true))
+			{
+				error = std::current_exception();
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	std::exception_ptr spawn_error;
+	try
+	{
+		workers.reserve(threads - 1);
+		for (unsigned t = 1; t < threads; ++t)
+		{
+			workers.emplace_back(work);
+		}
+	}
+	catch (...)
+	{
+		// The workers already started must be joined before unwinding
+		spawn_error = std::current_exception();
+		failed = true;
+	}
+	if (!spawn_error)
+	{
+		work(); // The calling thread is one of the workers
+	}
+	for (std::thread &worker : workers)
+	{
+		worker.join();
+	}
+
+	if (spawn_error)
+	{
+		std::rethrow_exception(spawn_error);
+	}
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+mapped_file::mapped_file(const std::string &path)
+	: data_(nullptr)
+	, size_(0)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		throw std::runtime_error("cannot open " + path);
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		throw std::runtime_error("cannot get the size of " + path);
+	}
+	size_ = static_cast<std::size_t>(size.QuadPart);
+
+	if (size_)
+	{
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			data_ = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			CloseHandle(mapping); // The view keeps the mapping alive
+		}
+	}
+	CloseHandle(file);
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		throw std::runtime_error("cannot open " + path);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("cannot get the size of " + path);
+	}
+	size_ = static_cast<std::size_t>(st.st_size);
+
+	if (size_)
+	{
+		void *data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			data_ = static_cast<const char *>(data);
+		}
+	}
+	close(fd); // The mapping keeps the file alive
+#endif
+
+	if (size_ && !data_)
+	{
+		throw std::runtime_error("cannot map " + path);
+	}
+}
+
+mapped_file::~mapped_file()
+{
+	if (data_)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(data_);
+#else
+		munmap(const_cast<char *>(data_), size_);
+#endif
+	}
+}
+
+namespace
+{
+	std::uint64_t mix(std::uint64_t h, std::uint64_t v)
+	{
+		h ^= v * 0x9E3779B97F4A7C15ull;
+		h ^= h >> 29;
+		return h * 0xBF58476D1CE4E5B9ull;
+	}
+}
+
+std::uint64_t hash_bytes(std::uint64_t seed, const char *data, std::size_t size)
+{
+	// Eight bytes at a time
+	std::uint64_t h = mix(seed, size);
+	std::size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		std::uint64_t v;
+		std::memcpy(&v, data + i, 8);
+		h = mix(h, v);
+	}
+	if (i < size)
+	{
+		std::uint64_t v = 0;
+		std::memcpy(&v, data + i, size - i);
+		h = mix(h, v);
+	}
+	return h ^ (h >> 32);
+}